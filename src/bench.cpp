@@ -0,0 +1,515 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <filesys.h>
+
+// Times the operations of Filesys on an image built by mkimage.x and
+// reports throughput and latency percentiles of each. Images are changed,
+// so run it on a copy
+
+// Bytes moved per random FileOperate call
+#define BENCH_IO 4096
+// Bytes moved per sequential FileOperate call
+#define BENCH_SEQ_IO 65536
+// Files removed or recovered per round
+#define BENCH_BATCH 32
+// Sessions running commands at once
+#define BENCH_SESSIONS 4
+
+class Bench
+{
+  public:
+    Bench(Filesys&, size_t, uint64_t);
+    void Run();
+
+  private:
+    // Directory found while walking the image
+    struct Dir
+    {
+        uint32_t clus;
+        std::string path;
+    };
+
+    Filesys& fs_;
+    size_t iterations_;
+    uint64_t rng_;
+    std::vector<Dir> dirs_;
+    std::string largest_;
+    uint32_t largestSize_;
+
+    uint64_t Random();
+    void Scan();
+    void Report(const std::string&, std::vector<double>&, uint64_t);
+    uint32_t MakeFiles(const std::string&, size_t,
+                       std::vector<std::string>&);
+    void Call(std::string, std::vector<std::string>);
+
+    void GetFileList();
+    void NavToDir(bool);
+    void AllocateCluster();
+    void FileOperate(uint32_t, bool, bool);
+    void Rm();
+    void Undelete();
+    void Sessions();
+};
+
+// Keeps command output of Filesys off the report while in scope
+class Quiet
+{
+  public:
+    Quiet() : saved_(std::cout.rdbuf(NULL)) {}
+    ~Quiet() { std::cout.rdbuf(saved_); }
+
+  private:
+    std::streambuf* saved_;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double Elapsed(Clock::time_point start)
+{
+  return std::chrono::duration<double, std::nano>(Clock::now() - start)
+         .count();
+}
+
+Bench::Bench(Filesys& fs, size_t iterations, uint64_t seed) : fs_(fs),
+                                                  iterations_(iterations),
+                                                  rng_(seed | 1),
+                                                  dirs_(),
+                                                  largest_(),
+                                                  largestSize_(0)
+{
+}
+
+// xorshift64, so runs with the same seed touch the same places
+uint64_t Bench::Random()
+{
+  rng_ ^= rng_ << 13;
+  rng_ ^= rng_ >> 7;
+  rng_ ^= rng_ << 17;
+  return rng_;
+}
+
+// Collects every directory and the largest file below the root
+void Bench::Scan()
+{
+  std::mutex lock;
+  Dir root = { fs_.finfo_.RootClus, "/" };
+
+  dirs_.push_back(root);
+  fs_.WalkTree(root.clus, root.path,
+     [this, &lock] (size_t, const std::string& path, Filesys::DirEntry& e)
+     {
+       std::lock_guard<std::mutex> guard(lock);
+       if (e.IsDir())
+       {
+         Dir dir = { e.clus, path };
+         dirs_.push_back(dir);
+       }
+       else if (e.size > largestSize_)
+       {
+         largest_ = path;
+         largestSize_ = e.size;
+       }
+     });
+
+  // The walk finishes in any order, sort so the seed decides the picks
+  std::sort(dirs_.begin(), dirs_.end(),
+            [] (const Dir& a, const Dir& b) { return a.path < b.path; });
+}
+
+// Prints one line for a set of latencies in nanoseconds, bytes is the
+// total moved by all of them or 0 if the operation moves no data
+void Bench::Report(const std::string& name, std::vector<double>& ns,
+                   uint64_t bytes)
+{
+  if (ns.empty())
+  {
+    std::cout << std::left << std::setw(22) << name << "skipped" << '\n';
+    return;
+  }
+
+  double total = 0;
+  for (double t : ns)
+    total += t;
+
+  std::sort(ns.begin(), ns.end());
+  auto pct = [&ns] (double p)
+  {
+    return ns[std::min(ns.size() - 1, (size_t)(p * ns.size()))] / 1000;
+  };
+
+  std::ostringstream rate;
+  rate << std::fixed << std::setprecision(1);
+  if (bytes != 0)
+    rate << bytes / (total / 1e9) / (1024 * 1024);
+  else
+    rate << "-";
+
+  std::cout << std::left << std::setw(22) << name << std::right
+            << std::setw(8) << ns.size()
+            << std::fixed << std::setprecision(0)
+            << std::setw(12) << ns.size() / (total / 1e9)
+            << std::setw(10) << rate.str()
+            << std::setprecision(1)
+            << std::setw(10) << pct(0.50)
+            << std::setw(10) << pct(0.90)
+            << std::setw(10) << pct(0.99)
+            << std::setw(10) << ns.back() / 1000 << '\n';
+}
+
+// Runs a shell command with the output silenced
+void Bench::Call(std::string cmd, std::vector<std::string> args)
+{
+  Quiet quiet;
+  fs_.CallFunct(cmd, args);
+}
+
+// Creates count files of one to four clusters each in a new directory
+// under the root and returns its cluster, or 0 if it could not be made
+uint32_t Bench::MakeFiles(const std::string& dir, size_t count,
+                          std::vector<std::string>& names)
+{
+  Quiet quiet;
+  uint32_t clusBytes = fs_.finfo_.BytesPerSec * fs_.finfo_.SecPerClus;
+  uint32_t location = fs_.MakeDir(fs_.finfo_.RootClus, dir);
+
+  if (location == 0)
+    return 0;
+
+  names.clear();
+  for (size_t i = 0; i < count; ++i)
+  {
+    char name[13];
+    snprintf(name, sizeof(name), "b%05u.dat", (unsigned)i);
+
+    Filesys::FileEntry* entry = fs_.MakeFile(location, name);
+    if (entry == NULL)
+      return 0;
+
+    uint32_t clusters = 1 + Random() % 4;
+    uint32_t first = fs_.AllocateClusters(clusters, 0, 0,
+                                          (uint64_t)clusters * clusBytes);
+    if (first != 0)
+    {
+      entry->SetClus(first);
+      entry->size = clusters * clusBytes;
+      fs_.SaveFileEntry(*entry);
+    }
+    delete entry;
+    names.push_back(name);
+  }
+  return location;
+}
+
+// Lists random directories straight from the image
+void Bench::GetFileList()
+{
+  std::vector<double> ns;
+
+  for (size_t i = 0; i < iterations_; ++i)
+  {
+    uint32_t clus = dirs_[Random() % dirs_.size()].clus;
+    Clock::time_point start = Clock::now();
+    Filesys::DirList list = fs_.GetFileList(clus);
+    ns.push_back(Elapsed(start));
+  }
+  Report("GetFileList", ns, 0);
+}
+
+// Resolves the absolute paths of random directories, either with the path
+// cache kept between calls or emptied before each
+void Bench::NavToDir(bool cold)
+{
+  std::vector<double> ns;
+
+  for (size_t i = 0; i < iterations_; ++i)
+  {
+    std::list<std::string> address =
+        fs_.ParseAddress(dirs_[Random() % dirs_.size()].path);
+
+    if (cold)
+      fs_.InvalidatePaths();
+
+    Clock::time_point start = Clock::now();
+    fs_.NavToDir(address, 0, address.size());
+    ns.push_back(Elapsed(start));
+  }
+  Report(cold ? "NavToDir cold" : "NavToDir warm", ns, 0);
+}
+
+// Allocates single clusters, freeing each again untimed
+void Bench::AllocateCluster()
+{
+  std::vector<double> ns;
+
+  for (size_t i = 0; i < iterations_; ++i)
+  {
+    Quiet quiet;
+    Clock::time_point start = Clock::now();
+    uint32_t clus = fs_.AllocateClusters(1);
+    double t = Elapsed(start);
+
+    if (clus == 0)
+      break;
+    ns.push_back(t);
+
+    fs_.SetNextClus(clus, 0);
+    fs_.UpdateClusCount([] (uint32_t value) { return value + 1; });
+  }
+  Report("AllocateCluster", ns, 0);
+}
+
+// Reads or writes the largest file in pieces of len bytes, at random
+// offsets or front to back
+void Bench::FileOperate(uint32_t len, bool write, bool sequential)
+{
+  std::string name = std::string(write ? "write " : "read ") +
+                     (sequential ? "seq " : "rand ") +
+                     std::to_string(len / 1024) + "k";
+  std::vector<double> ns;
+  uint64_t bytes = 0;
+
+  if (largestSize_ >= len)
+  {
+    size_t slash = largest_.rfind('/');
+    std::list<std::string> address = fs_.ParseAddress(
+        slash == 0 ? "/" : largest_.substr(0, slash));
+
+    fs_.Current().cwd = fs_.NavToDir(address, 0, address.size());
+    Call("open", { largest_.substr(slash + 1), "rw" });
+
+    std::vector<char> buffer(len, 'b');
+    Filesys::FileEntry& file = fs_.GetHandle(
+        fs_.FindHandle(fs_.Current().cwd, largest_.substr(slash + 1)))->
+        open->file;
+    uint32_t pos = 0;
+
+    for (size_t i = 0; i < iterations_; ++i)
+    {
+      if (sequential)
+      {
+        if (pos + len > largestSize_)
+          pos = 0;
+      }
+      else
+        pos = Random() % (largestSize_ - len + 1);
+
+      Clock::time_point start = Clock::now();
+      bytes += fs_.FileOperate(buffer.data(), pos, len, file,
+                               write ? Filesys::WRITE : Filesys::READ);
+      ns.push_back(Elapsed(start));
+      pos += len;
+    }
+
+    Call("close", { largest_.substr(slash + 1) });
+    fs_.Current().cwd = fs_.finfo_.RootClus;
+  }
+  Report(name, ns, bytes);
+}
+
+// Removes files one by one, a fresh directory of them per round
+void Bench::Rm()
+{
+  std::vector<double> ns;
+  std::vector<std::string> names;
+  size_t rounds = std::max<size_t>(1, iterations_ / BENCH_BATCH);
+
+  for (size_t r = 0; r < rounds; ++r)
+  {
+    std::ostringstream dir;
+    dir << "brm" << r;
+
+    fs_.Current().cwd = MakeFiles(dir.str(), BENCH_BATCH, names);
+    if (fs_.Current().cwd == 0)
+      break;
+
+    for (std::string& name : names)
+    {
+      Clock::time_point start = Clock::now();
+      Call("rm", { name });
+      ns.push_back(Elapsed(start));
+    }
+  }
+  fs_.Current().cwd = fs_.finfo_.RootClus;
+  Report("Rm", ns, 0);
+}
+
+// Recovers a directory of removed files per call
+void Bench::Undelete()
+{
+  std::vector<double> ns;
+  std::vector<std::string> names;
+  size_t rounds = std::max<size_t>(1, iterations_ / BENCH_BATCH);
+
+  for (size_t r = 0; r < rounds; ++r)
+  {
+    std::ostringstream dir;
+    dir << "bun" << r;
+
+    fs_.Current().cwd = MakeFiles(dir.str(), BENCH_BATCH, names);
+    if (fs_.Current().cwd == 0)
+      break;
+    Call("rm", names);
+
+    Clock::time_point start = Clock::now();
+    Call("undelete", {});
+    ns.push_back(Elapsed(start));
+  }
+  fs_.Current().cwd = fs_.finfo_.RootClus;
+  Report("Undelete x" + std::to_string(BENCH_BATCH), ns, 0);
+}
+
+// Changes into random directories and lists them from several sessions
+// at once, each printing to its own stream. Every listing is checked
+// against the one a session made alone
+void Bench::Sessions()
+{
+  std::vector<std::string> expected;
+  std::string cd = "cd";
+  std::string ls = "ls";
+
+  for (Dir& dir : dirs_)
+  {
+    std::ostringstream out;
+    std::vector<std::string> args = { dir.path };
+    Filesys::Session* session = fs_.OpenSession(out);
+
+    fs_.CallFunct(ls, args, session);
+    fs_.CloseSession(session);
+    expected.push_back(out.str());
+  }
+
+  std::vector<std::vector<double>> ns(BENCH_SESSIONS);
+  std::vector<std::thread> threads;
+  std::atomic<size_t> wrong(0);
+  size_t each = std::max<size_t>(1, iterations_ / BENCH_SESSIONS);
+
+  for (size_t t = 0; t < BENCH_SESSIONS; ++t)
+  {
+    uint64_t seed = Random() | 1;
+
+    threads.push_back(std::thread([&, t, seed] () mutable
+    {
+      std::ostringstream out;
+      Filesys::Session* session = fs_.OpenSession(out);
+      std::vector<std::string> none;
+
+      for (size_t i = 0; i < each; ++i)
+      {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+
+        size_t pick = seed % dirs_.size();
+        std::vector<std::string> args = { dirs_[pick].path };
+
+        Clock::time_point start = Clock::now();
+        fs_.CallFunct(cd, args, session);
+        out.str("");
+        fs_.CallFunct(ls, none, session);
+        ns[t].push_back(Elapsed(start));
+
+        if (out.str() != expected[pick])
+          ++wrong;
+      }
+      fs_.CloseSession(session);
+    }));
+  }
+
+  for (std::thread& thread : threads)
+    thread.join();
+
+  std::vector<double> all;
+  for (std::vector<double>& part : ns)
+    all.insert(all.end(), part.begin(), part.end());
+  Report("cd+ls x" + std::to_string(BENCH_SESSIONS) + " sessions", all, 0);
+
+  if (wrong > 0)
+    std::cout << "Error: " << wrong << " listings differed from the "
+              << "listing made alone" << '\n';
+}
+
+void Bench::Run()
+{
+  Scan();
+
+  std::cout << dirs_.size() << " directories, largest file "
+            << largestSize_ << " bytes, " << iterations_
+            << " iterations" << '\n'
+            << std::left << std::setw(22) << "operation" << std::right
+            << std::setw(8) << "ops" << std::setw(12) << "ops/s"
+            << std::setw(10) << "MB/s" << std::setw(10) << "p50 us"
+            << std::setw(10) << "p90 us" << std::setw(10) << "p99 us"
+            << std::setw(10) << "max us" << '\n';
+
+  GetFileList();
+  NavToDir(false);
+  NavToDir(true);
+  AllocateCluster();
+  FileOperate(BENCH_IO, false, false);
+  FileOperate(BENCH_SEQ_IO, false, true);
+  FileOperate(BENCH_IO, true, false);
+  FileOperate(BENCH_SEQ_IO, true, true);
+  Rm();
+  Undelete();
+  Sessions();
+}
+
+int main(int argc, char* argv[])
+{
+  Storage::Kind kind = Storage::AUTO;
+  size_t iterations = 10000;
+  uint64_t seed = 1;
+  int c;
+
+  while ((c = getopt(argc, argv, "mpdn:r:")) != -1)
+  {
+    switch (c)
+    {
+      case 'm': kind = Storage::MAP; break;
+      case 'p': kind = Storage::BLOCK; break;
+      case 'd': kind = Storage::DIRECT; break;
+      case 'n': iterations = strtoull(optarg, NULL, 10); break;
+      case 'r': seed = strtoull(optarg, NULL, 10); break;
+      default:
+        std::cerr << "Usage: " << argv[0]
+                  << " [-m | -p | -d] [-n iterations] [-r seed] <image>"
+                  << '\n';
+        return 1;
+    }
+  }
+
+  if (optind != argc - 1 || iterations == 0)
+  {
+    std::cerr << "Usage: " << argv[0]
+              << " [-m | -p | -d] [-n iterations] [-r seed] <image>" << '\n';
+    return 1;
+  }
+
+  Filesys fs(argv[optind], kind);
+
+  try
+  {
+    fs.Validate();
+  }
+  catch (std::exception &e)
+  {
+    std::cerr << "Invalid image" << '\n';
+    return 1;
+  }
+
+  Bench bench(fs, iterations, seed);
+  bench.Run();
+  return 0;
+}
@@ -0,0 +1,272 @@
+#include <fatscan.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FATSCAN_X86 1
+#else
+#define FATSCAN_X86 0
+#endif
+
+// Sets mask to take lower 28 bits
+#define FATMASK 0x0FFFFFFF
+// Entries handled by one call of a kernel
+#define BLOCK 64
+
+// Kernels over one block of entries, and over the words of a bitmap
+struct Kernels
+{
+  // Bit i is set if entry i of the block is free
+  uint64_t (*zeroMask)(const uint32_t*);
+  // True if both blocks are equal
+  bool (*same)(const uint32_t*, const uint32_t*);
+  // Index of the first word in [pos, end) that is not fill, end if none
+  size_t (*skipWords)(const uint64_t*, size_t, size_t, uint64_t);
+};
+
+static uint64_t ZeroMaskScalar(const uint32_t* p)
+{
+  uint64_t mask = 0;
+
+  for (size_t i = 0; i < BLOCK; ++i)
+  {
+    if ((p[i] & FATMASK) == 0)
+      mask |= (uint64_t)1 << i;
+  }
+  return mask;
+}
+
+static bool SameScalar(const uint32_t* a, const uint32_t* b)
+{
+  uint32_t diff = 0;
+
+  for (size_t i = 0; i < BLOCK; ++i)
+    diff |= a[i] ^ b[i];
+  return diff == 0;
+}
+
+static size_t SkipWordsScalar(const uint64_t* map, size_t pos, size_t end,
+                              uint64_t fill)
+{
+  while (pos < end && map[pos] == fill)
+    ++pos;
+  return pos;
+}
+
+#if FATSCAN_X86
+__attribute__((target("sse2")))
+static uint64_t ZeroMaskSse2(const uint32_t* p)
+{
+  const __m128i mask = _mm_set1_epi32(FATMASK);
+  const __m128i zero = _mm_setzero_si128();
+  uint64_t result = 0;
+
+  for (size_t i = 0; i < BLOCK; i += 4)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+    __m128i free = _mm_cmpeq_epi32(_mm_and_si128(v, mask), zero);
+    result |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(free)) << i;
+  }
+  return result;
+}
+
+__attribute__((target("sse2")))
+static bool SameSse2(const uint32_t* a, const uint32_t* b)
+{
+  __m128i diff = _mm_setzero_si128();
+
+  for (size_t i = 0; i < BLOCK; i += 4)
+  {
+    diff = _mm_or_si128(diff,
+             _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + i)),
+                           _mm_loadu_si128((const __m128i*)(b + i))));
+  }
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) ==
+         0xFFFF;
+}
+
+__attribute__((target("sse2")))
+static size_t SkipWordsSse2(const uint64_t* map, size_t pos, size_t end,
+                            uint64_t fill)
+{
+  const __m128i f = _mm_set1_epi64x(fill);
+
+  for (; pos + 2 <= end; pos += 2)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)(map + pos));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, f)) != 0xFFFF)
+      break;
+  }
+  return SkipWordsScalar(map, pos, end, fill);
+}
+
+__attribute__((target("avx2")))
+static uint64_t ZeroMaskAvx2(const uint32_t* p)
+{
+  const __m256i mask = _mm256_set1_epi32(FATMASK);
+  const __m256i zero = _mm256_setzero_si256();
+  uint64_t result = 0;
+
+  for (size_t i = 0; i < BLOCK; i += 8)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+    __m256i free = _mm256_cmpeq_epi32(_mm256_and_si256(v, mask), zero);
+    result |= (uint64_t)(uint32_t)
+              _mm256_movemask_ps(_mm256_castsi256_ps(free)) << i;
+  }
+  return result;
+}
+
+__attribute__((target("avx2")))
+static bool SameAvx2(const uint32_t* a, const uint32_t* b)
+{
+  __m256i diff = _mm256_setzero_si256();
+
+  for (size_t i = 0; i < BLOCK; i += 8)
+  {
+    diff = _mm256_or_si256(diff,
+             _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a + i)),
+                              _mm256_loadu_si256((const __m256i*)(b + i))));
+  }
+  return _mm256_testz_si256(diff, diff) != 0;
+}
+
+__attribute__((target("avx2")))
+static size_t SkipWordsAvx2(const uint64_t* map, size_t pos, size_t end,
+                            uint64_t fill)
+{
+  const __m256i f = _mm256_set1_epi64x(fill);
+
+  for (; pos + 4 <= end; pos += 4)
+  {
+    __m256i diff = _mm256_xor_si256(
+                     _mm256_loadu_si256((const __m256i*)(map + pos)), f);
+    if (_mm256_testz_si256(diff, diff) == 0)
+      break;
+  }
+  return SkipWordsScalar(map, pos, end, fill);
+}
+#endif
+
+static Kernels PickKernels()
+{
+#if FATSCAN_X86
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2"))
+  {
+    Kernels k = { &ZeroMaskAvx2, &SameAvx2, &SkipWordsAvx2 };
+    return k;
+  }
+  if (__builtin_cpu_supports("sse2"))
+  {
+    Kernels k = { &ZeroMaskSse2, &SameSse2, &SkipWordsSse2 };
+    return k;
+  }
+#endif
+  Kernels k = { &ZeroMaskScalar, &SameScalar, &SkipWordsScalar };
+  return k;
+}
+
+static const Kernels& GetKernels()
+{
+  static const Kernels kernels = PickKernels();
+  return kernels;
+}
+
+// Free mask of the entries from pos, for a whole block when one fits
+// before end and entry by entry otherwise
+static uint64_t ZeroMask(const Kernels& k, const uint32_t* entries,
+                         size_t pos, size_t end)
+{
+  if (end - pos >= BLOCK)
+    return k.zeroMask(entries + pos);
+
+  uint64_t mask = 0;
+  for (size_t i = pos; i < end; ++i)
+  {
+    if ((entries[i] & FATMASK) == 0)
+      mask |= (uint64_t)1 << (i - pos);
+  }
+  return mask;
+}
+
+size_t FatCountZero(const uint32_t* entries, size_t begin, size_t end)
+{
+  const Kernels& k = GetKernels();
+  size_t count = 0;
+
+  for (size_t pos = begin; pos < end; pos += BLOCK)
+    count += __builtin_popcountll(ZeroMask(k, entries, pos, end));
+  return count;
+}
+
+void FatZeroMap(const uint32_t* entries, size_t begin, size_t end,
+                uint64_t* map)
+{
+  const Kernels& k = GetKernels();
+  size_t pos = begin;
+
+  // Entry by entry up to the first whole word of the map
+  for (; pos < end && pos % 64 != 0; ++pos)
+  {
+    if ((entries[pos] & FATMASK) == 0)
+      map[pos / 64] |= (uint64_t)1 << (pos % 64);
+  }
+
+  for (; pos < end; pos += BLOCK)
+    map[pos / 64] |= ZeroMask(k, entries, pos, end);
+}
+
+size_t FatFindDiff(const uint32_t* a, const uint32_t* b, size_t begin,
+                   size_t end)
+{
+  const Kernels& k = GetKernels();
+
+  for (size_t pos = begin; pos < end; pos += BLOCK)
+  {
+    if (end - pos >= BLOCK && k.same(a + pos, b + pos))
+      continue;
+
+    size_t last = end - pos < BLOCK ? end : pos + BLOCK;
+    for (size_t i = pos; i < last; ++i)
+    {
+      if (a[i] != b[i])
+        return i;
+    }
+  }
+  return end;
+}
+
+// First bit in [begin, end) of map that differs from the bits of fill,
+// skipping whole words of fill with the kernel
+static size_t FindBit(const uint64_t* map, size_t begin, size_t end,
+                      uint64_t fill)
+{
+  if (begin >= end)
+    return end;
+
+  size_t word = begin / 64;
+  size_t words = (end + 63) / 64;
+  uint64_t bits = (map[word] ^ fill) & (~(uint64_t)0 << (begin % 64));
+
+  if (bits == 0)
+  {
+    word = GetKernels().skipWords(map, word + 1, words, fill);
+    if (word >= words)
+      return end;
+    bits = map[word] ^ fill;
+  }
+
+  size_t found = word * 64 + __builtin_ctzll(bits);
+  return found < end ? found : end;
+}
+
+size_t FatMapFindSet(const uint64_t* map, size_t begin, size_t end)
+{
+  return FindBit(map, begin, end, 0);
+}
+
+size_t FatMapFindClear(const uint64_t* map, size_t begin, size_t end)
+{
+  return FindBit(map, begin, end, ~(uint64_t)0);
+}
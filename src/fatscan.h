@@ -0,0 +1,28 @@
+#ifndef _FATSCAN_H
+#define _FATSCAN_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Scans over arrays of FAT entries in host byte order. Only the low 28 bits
+// of an entry are looked at when testing for a free cluster. Every scan
+// covers [begin, end) and returns end when nothing is found. The fastest
+// kernel the processor supports is picked on first use
+
+// Number of free entries
+size_t FatCountZero(const uint32_t*, size_t, size_t);
+// Sets bit i of the map for every free entry i
+void FatZeroMap(const uint32_t*, size_t, size_t, uint64_t*);
+// Index of the first entry at which two FAT copies differ in any bit
+size_t FatFindDiff(const uint32_t*, const uint32_t*, size_t, size_t);
+
+// Searches over a bitmap with bit i of word i / 64 standing for cluster i,
+// covering [begin, end) and returning end when nothing is found. Words of
+// the map that can not hold a match are skipped a vector at a time
+
+// Index of the first set bit, the first free cluster of a free map
+size_t FatMapFindSet(const uint64_t*, size_t, size_t);
+// Index of the first clear bit, where a run of free clusters ends
+size_t FatMapFindClear(const uint64_t*, size_t, size_t);
+
+#endif
@@ -1,4 +1,5 @@
 #include <filesys.h>
+#include <fatscan.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -11,6 +12,12 @@
 #include <ctime>
 #include <algorithm>
 #include <sstream>
+#include <cerrno>
+#include <dirent.h>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <type_traits>
 
 // Sets mask to take lower 28 bits
 #define FATMASK 0x0FFFFFFF
@@ -18,39 +25,239 @@
 #define FATEND 0x0FFFFFF8
 // File is not Allocated
 #define DEALLOC 0xe5
+// Flags the record holding the end of a long name, which comes first
+#define LFN_LAST 0x40
+// Records taken by the longest long name, 255 characters
+#define LFN_MAX 20
+// Number of resolved paths remembered by NavToDir
+#define PATHCACHE_SIZE 4096
+// Bounds in clusters of the read-ahead window for sequential reads
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX 256
+// FAT entries handed to each task of a whole-FAT scan
+#define CHECK_CHUNK 65536
+// Problems of each kind printed in full by check
+#define CHECK_REPORT_MAX 16
+// Marks a bad cluster in the FAT
+#define FATBAD 0x0FFFFFF7
+// Pending FAT blocks and directory records that force an early flush
+#define WRITEBACK_MAX 4096
+// Leads a journal of the write-back batch being applied
+#define JOURNAL_MAGIC "FATJRNL1"
+// Bytes copied at a time through a buffer when the image is not mapped
+#define COPY_CHUNK 1048576
+// Recovered entries a directory may hold before undelete stops
+#define UNDELETE_MAX 99
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_IS_LE 0
+#else
+#define HOST_IS_LE 1
+#endif
+
+// Loads a little endian value of exactly sizeof(T) bytes
+template <typename T>
+static inline T LoadLE(const uint8_t* src)
+{
+  T value;
+  memcpy(&value, src, sizeof(T));
+
+  if (!HOST_IS_LE && sizeof(T) > 1)
+  {
+    T swapped = 0;
+    for (size_t p = 0; p < sizeof(T); ++p)
+      swapped |= (T)src[p] << (8 * p);
+    value = swapped;
+  }
+  return value;
+}
+
+// Stores a value as exactly sizeof(T) little endian bytes
+template <typename T>
+static inline void StoreLE(uint8_t* dst, T value)
+{
+  if (!HOST_IS_LE && sizeof(T) > 1)
+  {
+    for (size_t p = 0; p < sizeof(T); ++p)
+    {
+      dst[p] = (uint8_t)(value & 0xFF);
+      value = value >> 8;
+    }
+    return;
+  }
+  memcpy(dst, &value, sizeof(T));
+}
+
+// Checksum of an 8.3 name kept in each record of its long name
+static uint8_t ShortNameSum(const uint8_t* name)
+{
+  uint8_t sum = 0;
+
+  for (size_t i = 0; i < 11; ++i)
+    sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+  return sum;
+}
+
+// Long names are matched regardless of case
+static std::string FoldName(std::string name)
+{
+  std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+  return name;
+}
+
+// Converts UTF-8 to the UTF-16 of long name records, returns false if
+// name is not valid UTF-8
+static bool DecodeUtf8(const std::string& name, std::vector<uint16_t>& out)
+{
+  out.clear();
+
+  for (size_t i = 0; i < name.length(); )
+  {
+    uint8_t c = name[i];
+    size_t extra = c < 0x80 ? 0 : (c >> 5) == 0x6 ? 1 : 
+                   (c >> 4) == 0xE ? 2 : (c >> 3) == 0x1E ? 3 : 4;
+
+    if (extra > 3 || i + extra > name.length() - 1)
+      return false;
+
+    uint32_t point = extra == 0 ? c : c & (0x3F >> extra);
+    for (size_t k = 1; k <= extra; ++k)
+    {
+      if ((name[i + k] & 0xC0) != 0x80)
+        return false;
+      point = (point << 6) | (name[i + k] & 0x3F);
+    }
+    i += extra + 1;
+
+    if (point >= 0x10000)
+    {
+      point -= 0x10000;
+      out.push_back(0xD800 | (point >> 10));
+      out.push_back(0xDC00 | (point & 0x3FF));
+    }
+    else
+      out.push_back(point);
+  }
+  return true;
+}
+
+// Converts the UTF-16 of long name records, up to a terminator, to UTF-8
+static void EncodeUtf8(const std::vector<uint16_t>& chars, 
+                       std::string& name)
+{
+  for (size_t i = 0; i < chars.size() && chars[i] != 0 && 
+                     chars[i] != 0xFFFF; ++i)
+  {
+    uint32_t point = chars[i];
+
+    if (point >= 0xD800 && point < 0xDC00 && i + 1 < chars.size())
+      point = 0x10000 + ((point & 0x3FF) << 10) + (chars[++i] & 0x3FF);
+
+    if (point < 0x80)
+      name.push_back(point);
+    else if (point < 0x800)
+    {
+      name.push_back(0xC0 | (point >> 6));
+      name.push_back(0x80 | (point & 0x3F));
+    }
+    else if (point < 0x10000)
+    {
+      name.push_back(0xE0 | (point >> 12));
+      name.push_back(0x80 | ((point >> 6) & 0x3F));
+      name.push_back(0x80 | (point & 0x3F));
+    }
+    else
+    {
+      name.push_back(0xF0 | (point >> 18));
+      name.push_back(0x80 | ((point >> 12) & 0x3F));
+      name.push_back(0x80 | ((point >> 6) & 0x3F));
+      name.push_back(0x80 | (point & 0x3F));
+    }
+  }
+}
+
+// Returns true if name can be stored as a long name
+static bool IsLongName(const std::string& name)
+{
+  std::vector<uint16_t> chars;
+
+  if (name.empty() || name == "." || name == ".." || 
+      name.back() == '.' || name.back() == ' ' || 
+      !DecodeUtf8(name, chars) || chars.size() > LFN_MAX * 13)
+    return false;
+
+  for (char c : name)
+  {
+    if ((uint8_t)c < 0x20 || strchr("\"*/:<>?\\|", c) != NULL)
+      return false;
+  }
+  return true;
+}
+
+thread_local Filesys::Session* Filesys::session_ = NULL;
+thread_local Filesys::Scope* Filesys::scope_ = NULL;
+thread_local std::vector<std::pair<std::vector<Filesys::DirEntry>, 
+                                  std::string>> Filesys::dirArena_;
+
+// Path of a file kept for the image, named after it and in dir if one is
+// given
+static std::string StatePath(const std::string& image, 
+                             const std::string& dir, const char* suffix)
+{
+  if (dir.empty())
+    return image + suffix;
+
+  size_t slash = image.rfind('/');
+  std::string base = slash == std::string::npos ? image : 
+                     image.substr(slash + 1);
+  return dir + "/" + base + suffix;
+}
 
-Filesys::Filesys(std::string fname) : mFilesys_(0), 
+Filesys::Filesys(std::string fname, Storage::Kind kind, 
+                 std::string stateDir) : mFilesys_(0), 
                                       filesys_size_(0),
                                       fname_(fname),
-                                      fd_(0),
+                                      storage_(NULL),
                                       error_(false), 
                                       functions_(),
-                                      cwd_(),
                                       finfo_(),
-                                      openTable_()
+                                      fat_(),
+                                      treeLock_(),
+                                      readers_(),
+                                      sessions_(1),
+                                      openFiles_(),
+                                      openIndex_(),
+                                      openLock_(),
+                                      cacheLock_(),
+                                      dirCache_(),
+                                      dirOfClus_(),
+                                      pathLock_(),
+                                      pathLru_(),
+                                      pathIndex_(),
+                                      parentOf_(),
+                                      poolOnce_(),
+                                      pool_(NULL),
+                                      pendingRecords_(),
+                                      holdFlush_(false),
+                                      stateDir_(stateDir),
+                                      journalName_(StatePath(fname, stateDir,
+                                                             ".journal")),
+                                      defragName_(StatePath(fname, stateDir,
+                                                            ".defrag")),
+                                      ioLock_(),
+                                      io_(NULL),
+                                      stats_()
 {
-  struct stat fstatus;
-
-  // Open File Descriptor
-  fd_ = open(fname_.c_str(), O_RDWR);
-
-  if (fd_ < 0)
-  {
-    error_ = true;
-    return;
-  }
+  storage_ = Storage::Open(fname_, kind);
 
-  // Get File Stats
-  if (fstat(fd_, &fstatus) < 0)
+  if (storage_->HasError())
   {
     error_ = true;
     return;
   }
 
-  // Map file to array -> mFilesys_
-  filesys_size_ = fstatus.st_size;
-  mFilesys_ = (uint8_t*)mmap(0, filesys_size_, PROT_READ |
-      PROT_WRITE | PROT_EXEC, MAP_SHARED, fd_, 0);
+  filesys_size_ = storage_->Size();
+  mFilesys_ = storage_->Map();
 
   // Register functions here
   functions_.insert(std::make_pair("fsinfo", &Filesys::Fsinfo));
@@ -66,15 +273,127 @@ Filesys::Filesys(std::string fname) : mFilesys_(0),
   functions_.insert(std::make_pair("rmdir", &Filesys::Rmdir));
   functions_.insert(std::make_pair("create", &Filesys::Create));
   functions_.insert(std::make_pair("undelete", &Filesys::Undelete));
+  functions_.insert(std::make_pair("import", &Filesys::Import));
+  functions_.insert(std::make_pair("export", &Filesys::Export));
+  functions_.insert(std::make_pair("lsr", &Filesys::Lsr));
+  functions_.insert(std::make_pair("du", &Filesys::Du));
+  functions_.insert(std::make_pair("find", &Filesys::Find));
+  functions_.insert(std::make_pair("cksum", &Filesys::Cksum));
+  functions_.insert(std::make_pair("check", &Filesys::Check));
+  functions_.insert(std::make_pair("frag", &Filesys::Frag));
+  functions_.insert(std::make_pair("defrag", &Filesys::Defrag));
+  functions_.insert(std::make_pair("sync", &Filesys::Sync));
   functions_.insert(std::make_pair("help", &Filesys::Help));
+  functions_.insert(std::make_pair("stats", &Filesys::Stats));
+
+  // Export only reads the image, it takes ioLock_ for the engine
+  const char* readers[] = { "fsinfo", "ls", "cd", "size", "open", "read",
+                            "export", "lsr", "du", "find", "cksum", 
+                            "check", "frag", "help", "stats" };
+  readers_.insert(std::begin(readers), std::end(readers));
+}
+
+Filesys::Session::Session(std::ostream& output) : cwd(0), 
+                                                  location("/"), 
+                                                  openFiles(), 
+                                                  openByLoc(), 
+                                                  nextHandle(1),
+                                                  out(output),
+                                                  failed(false)
+{
+}
+
+Filesys::Scope::Scope(Filesys& fs, Session* session, bool shared) : 
+                      fs_(fs), caller_(session_), outer_(scope_), 
+                      shared_(shared)
+{
+  fs_.treeLock_.Lock(shared_);
+  session_ = session != NULL ? session : &fs_.sessions_.front();
+  scope_ = this;
+}
+
+Filesys::Scope::~Scope()
+{
+  scope_ = outer_;
+  session_ = caller_;
+  fs_.treeLock_.Unlock(shared_);
+}
+
+// Lets other commands at the tree for seconds, then takes the lock back.
+// Anything looked up before may have changed by the time this returns
+void Filesys::Scope::Pause(double seconds)
+{
+  fs_.treeLock_.Unlock(shared_);
+  std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+  fs_.treeLock_.Lock(shared_);
+}
+
+// Session of the command running on this thread, the shell outside of one
+Filesys::Session& Filesys::Current()
+{
+  return session_ != NULL ? *session_ : sessions_.front();
+}
+
+// Stream the command running on this thread prints to
+std::ostream& Filesys::Out()
+{
+  return Current().out;
+}
+
+// Marks the command running on this thread as failed, and returns the
+// stream to say why on
+std::ostream& Filesys::Fail()
+{
+  Current().failed = true;
+  return Current().out;
+}
+
+// Starts a session in the root directory for another client, printing
+// to out
+Filesys::Session* Filesys::OpenSession(std::ostream& out)
+{
+  Scope scope(*this, NULL, false);
+
+  sessions_.push_back(Session(out));
+  sessions_.back().cwd = finfo_.RootClus;
+  return &sessions_.back();
+}
+
+// Closes the files of a session and forgets it, the shell's session is
+// kept
+void Filesys::CloseSession(Session* session)
+{
+  Scope scope(*this, session, false);
+
+  if (session == &sessions_.front())
+    return;
+
+  for (auto& open : session->openFiles)
+    ReleaseFile(*open.second.open);
+  session->openFiles.clear();
+  session->openByLoc.clear();
+  Flush();
+
+  for (std::list<Session>::iterator s = sessions_.begin(); 
+       s != sessions_.end(); ++s)
+  {
+    if (&*s == session)
+    {
+      session_ = NULL;
+      sessions_.erase(s);
+      break;
+    }
+  }
 }
 
 // Close file descriptor and unmaps files ystem
 Filesys::~Filesys()
 {
-  munmap(mFilesys_, filesys_size_);
-  if (fd_ >= 0)
-    close(fd_);
+  delete pool_;
+  if (!error_)
+    Flush();
+  delete io_;
+  delete storage_;
 }
 
 // Retreives and Validates information from the file system
@@ -83,6 +402,9 @@ void Filesys::Validate()
   if (error_)
     throw  std::exception();
 
+  CheckJournal();
+  ReplayJournal();
+
   ReadValue(finfo_.Signature, 2, 510, 1);
 
   if (finfo_.Signature[0] != 0x55 || finfo_.Signature[1] != 0xaa)
@@ -111,6 +433,7 @@ void Filesys::Validate()
   if (finfo_.SecPerClus != 1 &&
       finfo_.SecPerClus != 2 &&
       finfo_.SecPerClus != 4 &&
+      finfo_.SecPerClus != 8 &&
       finfo_.SecPerClus != 16 &&
       finfo_.SecPerClus != 32 &&
       finfo_.SecPerClus != 64 &&
@@ -132,1485 +455,4668 @@ void Filesys::Validate()
   if (finfo_.FATSz16 != 0)
     throw std::exception();
 
-  cwd_ = finfo_.RootClus;
-  location_ = "/";
+  finfo_.SetGeometry();
+  LoadFatCache();
+
+  sessions_.front().cwd = finfo_.RootClus;
+  sessions_.front().location = "/";
 }
 
-// Returns string location
-std::string Filesys::GetLocation()
+// Reads the first FAT into memory and marks every free cluster
+void Filesys::LoadFatCache()
 {
-  return location_;
+  uint32_t nEntries = finfo_.FATSz * finfo_.BytesPerSec / 4;
+
+  fat_.entries.assign(nEntries, 0);
+  // The bound is exclusive, the highest cluster of the data region is
+  // free to allocate like any other
+  fat_.endOfFat = GetClusLimit();
+  fat_.freeMap.assign(nEntries / 64 + 1, 0);
+  fat_.dirtyMap.assign(nEntries / 4096 + 1, 0);
+  fat_.dirtyBlocks = 0;
+  ReadValue(fat_.entries.data(), nEntries, 
+            finfo_.RsvdSecCnt * finfo_.BytesPerSec, 4);
+
+  if (fat_.endOfFat > 2)
+    FatZeroMap(fat_.entries.data(), 2, fat_.endOfFat, fat_.freeMap.data());
+
+  // Other tools often leave FSInfo stale or unset, and counting the cache
+  // costs little next to reading it, so the count is never taken on trust
+  STAT_ADD(stats_, FAT_SCANS, 1);
+  fat_.freeCount = fat_.endOfFat > 2 ? 
+                   FatCountZero(fat_.entries.data(), 2, fat_.endOfFat) : 0;
+  fat_.nextFree = 2;
+  fat_.dirty = false;
+
+  if (HasFsInfo())
+  {
+    uint32_t hint = GetFATNxtFree();
+    if (hint >= 2 && hint < fat_.endOfFat)
+      fat_.nextFree = hint;
+  }
 }
 
-// Returns if there is an error
-bool Filesys::HasError()
+// Checks the three signatures of the FSInfo sector
+bool Filesys::HasFsInfo()
 {
-  return error_;
+  size_t pos = (size_t)finfo_.FsInfo * finfo_.BytesPerSec;
+  uint32_t lead, strc, trail;
+
+  if (finfo_.FsInfo == 0 || finfo_.FsInfo >= finfo_.RsvdSecCnt ||
+      pos + 512 > filesys_size_)
+    return false;
+
+  ReadValue(&lead, 1, pos, 4);
+  ReadValue(&strc, 1, pos + 484, 4);
+  ReadValue(&trail, 1, pos + 508, 4);
+
+  return lead == 0x41615252 && strc == 0x61417272 && trail == 0xAA550000;
 }
 
-// Calls functions and passes them arguements
-bool Filesys::CallFunct(std::string& name, 
-                        std::vector<std::string>& argv)
+// Marks the blocks of 64 FAT entries covering [start, start + length) as
+// needing to be written to every FAT copy
+void Filesys::MarkFatDirty(uint32_t start, uint32_t length)
 {
-  try
-  {
-    functions_.at(name)(*this, argv);
-  }
-  catch (std::exception &e)
+  if (length == 0)
+    return;
+
+  for (uint32_t b = start / 64; b <= (start + length - 1) / 64; ++b)
   {
-    return false;
+    uint64_t bit = (uint64_t)1 << (b % 64);
+    if ((fat_.dirtyMap[b / 64] & bit) == 0)
+    {
+      fat_.dirtyMap[b / 64] |= bit;
+      ++fat_.dirtyBlocks;
+    }
   }
-  return true;
+
+  FlushIfFull();
 }
 
-// Gets list of files in specified cluster
-// if getDealloc is false, return only allocated files
-// if getDealloc is true, return only deallcoated files
-// Return value must be deallocated after use
-std::list<Filesys::FileEntry>* Filesys::GetFileList(uint32_t cluster, 
-                                                    bool getDealloc)
+// Flushes early once the write-back batch grows past WRITEBACK_MAX, unless
+// a change that has to reach the image whole is being made
+void Filesys::FlushIfFull()
 {
-  uint32_t entries = finfo_.BytesPerSec * finfo_.SecPerClus / 32;
-  uint32_t currentCluster = cluster;
-  uint32_t location;
+  if (!holdFlush_ && 
+      fat_.dirtyBlocks + pendingRecords_.size() > WRITEBACK_MAX)
+    Flush();
+}
+
+// Copies the directory record at pos, as it will be once flushed
+void Filesys::ReadRecord(uint8_t* record, size_t pos)
+{
+  auto found = pendingRecords_.find(pos);
+
+  if (found != pendingRecords_.end())
+    memcpy(record, found->second.data(), 32);
+  else
+    ReadBytes(record, 32, pos);
+}
 
-  std::list<FileEntry>* list = new std::list<FileEntry>;
+// Forgets pending records in a range about to be overwritten, so that a
+// flush does not write them over whatever takes their place
+void Filesys::DropRecords(size_t pos, size_t len)
+{
+  pendingRecords_.erase(pendingRecords_.lower_bound(pos),
+                        pendingRecords_.lower_bound(pos + len));
+}
 
-  char name[12];
-  uint8_t attr;
-  uint16_t lo;
-  uint16_t hi;
-  uint32_t size;
+// FNV-1a over the journal, to tell a complete one from a torn one
+static uint32_t JournalSum(const uint8_t* data, size_t len)
+{
+  uint32_t sum = 2166136261u;
 
-  name[11] = '\0';
+  for (size_t i = 0; i < len; ++i)
+    sum = (sum ^ data[i]) * 16777619u;
+  return sum;
+}
 
-  // Loop through each entry and navigate to next clusters if necessary
-  do 
+// Writes every dirty FAT block to each FAT copy, every pending directory
+// record, and FSInfo if it is dirty, in one batch in image order. The batch
+// is written and synced to the journal before any of it reaches the image,
+// and the journal is removed once the image has been synced, so a crash 
+// part way through is finished by ReplayJournal at the next mount
+void Filesys::Flush()
+{
+  struct Change
   {
-    location = finfo_.BytesPerSec * 
-                   finfo_.GetFirstSectorOfClus(currentCluster);
+      size_t pos;
+      size_t offset;
+      size_t len;
+  };
+  std::vector<Change> changes;
+  std::vector<uint8_t> data;
+
+  auto add = [&changes, &data] (size_t pos, const uint8_t* bytes, 
+                                size_t len)
+  {
+    Change c = { pos, data.size(), len };
+    changes.push_back(c);
+    data.insert(data.end(), bytes, bytes + len);
+  };
 
-    for (uint32_t i = 0; i < entries; ++i)
-    {
-      ReadValue(name, 11, location + (32 * i), 1);
-      ReadValue(&attr, 1, location + (32 * i) + 11, 1);
-      ReadValue(&hi, 1, location + (32 * i) + 20, 2);
-      ReadValue(&lo, 1, location + (32 * i) + 26, 2);
-      ReadValue(&size, 1, location + (32 * i) + 28, 4);
+  // Neighbouring dirty blocks go out as one run of entries
+  size_t nBlocks = (fat_.entries.size() + 63) / 64;
+  std::vector<uint8_t> run;
 
-      if ((attr & LONG) == LONG)
-        continue;
+  for (size_t b = 0; b < nBlocks && fat_.dirtyBlocks > 0; ++b)
+  {
+    if ((fat_.dirtyMap[b / 64] & ((uint64_t)1 << (b % 64))) == 0)
+      continue;
 
-      if ((name[0] != 0 && (uint8_t)name[0] != DEALLOC && !getDealloc) ||
-          ((name[0] == 0 || (uint8_t)name[0] == DEALLOC) && getDealloc))
-      {
-        FileEntry entry(name, attr, lo, hi, size, location + (32 * i));
-        list->push_back(entry);
-      }
+    size_t first = b;
+    while (b + 1 < nBlocks && 
+           (fat_.dirtyMap[(b + 1) / 64] & ((uint64_t)1 << ((b + 1) % 64))))
+      ++b;
+
+    size_t begin = first * 64;
+    size_t end = std::min((b + 1) * 64, fat_.entries.size());
+
+    run.resize((end - begin) * 4);
+    for (size_t i = begin; i < end; ++i)
+      StoreLE<uint32_t>(&run[(i - begin) * 4], fat_.entries[i]);
+
+    for (uint32_t copy = 0; copy < finfo_.NumFats; ++copy)
+    {
+      add(((size_t)finfo_.RsvdSecCnt + (size_t)copy * finfo_.FATSz) * 
+          finfo_.BytesPerSec + begin * 4, run.data(), run.size());
     }
-    currentCluster = GetNextClus(currentCluster);
-  } while (currentCluster < FATEND);
+  }
 
-  return list;
-}
+  for (auto& record : pendingRecords_)
+    add(record.first, record.second.data(), 32);
 
-// Reads from filesystem into data
-template <typename T>
-void Filesys::ReadValue(T* data, size_t len, size_t pos, 
-     size_t width)
-{
-  if (width * len + pos >= filesys_size_)
-    throw std::exception();
+  if (fat_.dirty && HasFsInfo())
+  {
+    uint8_t info[8];
+    StoreLE<uint32_t>(info, fat_.freeCount);
+    StoreLE<uint32_t>(info + 4, fat_.nextFree < fat_.endOfFat ? 
+                                fat_.nextFree : 0xFFFFFFFF);
+    add((size_t)finfo_.FsInfo * finfo_.BytesPerSec + 488, info, 8);
+  }
 
-  for (size_t i = 0; i < len; ++i)
+  std::fill(fat_.dirtyMap.begin(), fat_.dirtyMap.end(), 0);
+  fat_.dirtyBlocks = 0;
+  fat_.dirty = false;
+  pendingRecords_.clear();
+
+  if (changes.empty())
+    return;
+
+  std::sort(changes.begin(), changes.end(), 
+            [] (const Change& a, const Change& b) { return a.pos < b.pos; });
+
+  // Journal layout: magic, count, then per change its position, length
+  // and bytes, then the checksum of all that
+  std::vector<uint8_t> log(JOURNAL_MAGIC, JOURNAL_MAGIC + 8);
+  uint8_t field[12];
+
+  StoreLE<uint32_t>(field, changes.size());
+  log.insert(log.end(), field, field + 4);
+
+  for (Change& c : changes)
   {
-    data[i] = 0;
-    for (size_t p = 0; p < width; ++p)
-      data[i] |= mFilesys_[pos + (i * width) + p] << (8 * p);
+    StoreLE<uint64_t>(field, c.pos);
+    StoreLE<uint32_t>(field + 8, c.len);
+    log.insert(log.end(), field, field + 12);
+    log.insert(log.end(), &data[c.offset], &data[c.offset] + c.len);
   }
-}
 
-// Writes from data to filesystem
-template <typename T>
-void Filesys::WriteValue(T* data, size_t len, size_t pos, 
-                         size_t width)
-{
-  T tData;
-  T mask = 0xFF;
+  StoreLE<uint32_t>(field, JournalSum(log.data(), log.size()));
+  log.insert(log.end(), field, field + 4);
 
-  if (width * len + pos >= filesys_size_)
-    throw std::exception();
+  bool logged = false;
+  int fd = open(journalName_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-  for (size_t i = 0; i < len; ++i)
+  if (fd >= 0)
   {
-    tData = data[i];
-    for (size_t p = 0; p < width; ++p)
+    size_t done = 0;
+    while (done < log.size())
     {
-      mFilesys_[pos + (i * width) + p] = (uint8_t)(tData & mask);
-      tData = tData >> 8;
+      ssize_t put = write(fd, &log[done], log.size() - done);
+      if (put < 0 && errno == EINTR)
+        continue;
+      if (put <= 0)
+        break;
+      done += put;
     }
+    logged = done == log.size() && fsync(fd) == 0;
+    close(fd);
   }
+
+  if (!logged)
+    Out() << "Error: Unable to write journal, flushing without it" 
+          << '\n';
+
+  for (Change& c : changes)
+    WriteBytes(&data[c.offset], c.len, c.pos);
+
+  storage_->Sync();
+  unlink(journalName_.c_str());
 }
 
-// Writes or reads a file depending on the function passed to it
-// Assumes that memory has been allocated for it
-uint32_t Filesys::FileOperate(char* stream, uint32_t start, 
-     uint32_t length, FileEntry& file, 
-     std::function<void (Filesys&, char*, size_t, size_t, size_t)> funct)
+// Warns when the journal can not do its job where it is kept. Beside a
+// block device it would land in /dev, which is lost with the power, and
+// in a directory that can not be written it is never made at all
+void Filesys::CheckJournal()
 {
-  uint32_t clusSize = finfo_.BytesPerSec * finfo_.SecPerClus; 
+  struct stat status;
+  size_t slash = journalName_.rfind('/');
+  std::string dir = slash == std::string::npos ? "." : 
+                    slash == 0 ? "/" : journalName_.substr(0, slash);
 
-  uint32_t clusNum = start / clusSize;
-  uint32_t clusOffset = start % clusSize;
-  uint32_t curClus = file.clus;
+  if (stateDir_.empty() && stat(fname_.c_str(), &status) == 0 && 
+      S_ISBLK(status.st_mode))
+  {
+    Out() << "Warning: The journal of a block device would be kept in "
+          << dir << ", which does not survive a power loss. Give a "
+          << "directory for it with -j" << '\n';
+  }
+  else if (access(dir.c_str(), W_OK) != 0)
+  {
+    Out() << "Warning: Unable to write the journal in " << dir 
+          << ", changes will be flushed without it" << '\n';
+  }
+}
+
+// Applies the journal left behind by a flush that did not finish. A
+// journal that is torn was never applied and is thrown away
+void Filesys::ReplayJournal()
+{
+  int fd = open(journalName_.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+
+  std::vector<uint8_t> log;
+  uint8_t buffer[65536];
+  ssize_t got;
 
-  for (uint32_t i = 0; i < clusNum; ++i)
+  while ((got = read(fd, buffer, sizeof(buffer))) > 0 || 
+         (got < 0 && errno == EINTR))
   {
-    curClus = GetNextClus(curClus);
-    if (curClus >= FATEND)
-    {
-      std::cout << "Error: Start Parameter out of bounds"
-                << std::endl;
-      return 0;
-    }
+    if (got > 0)
+      log.insert(log.end(), buffer, buffer + got);
   }
+  close(fd);
 
-  uint32_t amountTran = 0;
-  uint32_t loc, remaining, tran;
+  bool valid = log.size() >= 16 && 
+               memcmp(log.data(), JOURNAL_MAGIC, 8) == 0 &&
+               LoadLE<uint32_t>(&log[log.size() - 4]) == 
+               JournalSum(log.data(), log.size() - 4);
+  uint32_t count = valid ? LoadLE<uint32_t>(&log[8]) : 0;
+  size_t pos = 12;
 
-  while (amountTran < length && curClus < FATEND)
+  for (uint32_t i = 0; i < count && valid; ++i)
   {
-    remaining = finfo_.BytesPerSec * finfo_.SecPerClus - 
-                clusOffset;
-    tran = length - amountTran;
-    loc = finfo_.BytesPerSec * 
-          finfo_.GetFirstSectorOfClus(curClus);
+    if (pos + 12 > log.size() - 4)
+    {
+      valid = false;
+      break;
+    }
 
-    if (tran > remaining)
-      tran = remaining;
+    uint64_t at = LoadLE<uint64_t>(&log[pos]);
+    uint32_t len = LoadLE<uint32_t>(&log[pos + 8]);
+    pos += 12;
 
-    funct(*this, stream + amountTran, tran, loc + clusOffset, 1);
-    amountTran += tran; 
-    curClus = GetNextClus(curClus);
-    clusOffset = 0;
+    if (pos + len > log.size() - 4 || at + len > filesys_size_)
+    {
+      valid = false;
+      break;
+    }
+    pos += len;
   }
-  return amountTran;
-}
-
-// Goes to FAT and returns next cluster in the file
-uint32_t Filesys::GetNextClus(uint32_t cluster)
-{
-  uint32_t entry;
-  ReadValue(&entry, 1, finfo_.GetThisFatSecN(cluster) * 
-                       finfo_.BytesPerSec + 
-                       finfo_.GetThisFatEntOff(cluster), 4);
-  return entry & FATMASK;
-}
 
-// Goes to FAT and sets cluster, fatLoc specfies the cluster
-void Filesys::SetNextClus(uint32_t fatLoc, uint32_t value)
-{
-  uint32_t entry;
-  for (uint8_t i = 0; i < finfo_.NumFats; ++i)
+  if (valid)
   {
-    ReadValue(&entry, 1, (finfo_.GetThisFatSecN(fatLoc) + 
-                            (i * finfo_.FATSz)) * 
-                         finfo_.BytesPerSec + 
-                         finfo_.GetThisFatEntOff(fatLoc), 4);
-    entry = entry & (~FATMASK);
-    value = value & FATMASK;
-    entry = entry | value;
-    WriteValue(&value, 1, (finfo_.GetThisFatSecN(fatLoc) + 
-                              (i * finfo_.FATSz)) *
-                         finfo_.BytesPerSec + 
-                         finfo_.GetThisFatEntOff(fatLoc), 4);
+    pos = 12;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+      uint64_t at = LoadLE<uint64_t>(&log[pos]);
+      uint32_t len = LoadLE<uint32_t>(&log[pos + 8]);
+      WriteBytes(&log[pos + 12], len, at);
+      pos += 12 + len;
+    }
+    storage_->Sync();
+    Out() << "Recovered " << count << " metadata writes from journal"
+          << '\n';
   }
+
+  unlink(journalName_.c_str());
 }
 
-void Filesys::UpdateClusCount(std::function<uint32_t (uint32_t)> op)
+// Returns string location of session
+std::string Filesys::GetLocation(Session* session)
 {
-  uint32_t clusCount = GetNFreeClus();
-  clusCount = op(clusCount);
-  SetNFreeClus(clusCount);
+  Scope scope(*this, session, true);
+  return Current().location;
 }
 
-// Indicates where to begin looking for empty clusters in the FAT
-uint32_t Filesys::GetFATNxtFree()
+// Returns if the last command of session reported a failure
+bool Filesys::Failed(Session* session)
 {
-  uint32_t value;
-  ReadValue(&value, 1, finfo_.BytesPerSec * finfo_.FsInfo + 492, 4);
-
-  return value;
+  Scope scope(*this, session, true);
+  return Current().failed;
 }
 
-// Sets where to begin looking for empty clusters in the FAT
-void Filesys::SetFATNxtFree(uint32_t cluster)
+// Returns if there is an error
+bool Filesys::HasError()
 {
-  WriteValue(&cluster, 1, finfo_.BytesPerSec * finfo_.FsInfo + 492, 4);
+  return error_;
 }
 
-// Calculates number of free clusters from FsInfo section 
-uint32_t Filesys::GetNFreeClus()
+// Calls functions and passes them arguements, on behalf of session
+bool Filesys::CallFunct(std::string& name, 
+                        std::vector<std::string>& argv, Session* session)
 {
-  uint32_t value;
+  try
+  {
+    Scope scope(*this, session, readers_.count(name) != 0);
+    STAT_ADD(stats_, COMMANDS, 1);
+    Current().failed = false;
+    functions_.at(name)(*this, argv);
+  }
+  catch (std::exception &e)
+  {
+    return false;
+  }
+  return true;
+}
+
+// Feeds lfn the long name records at the end of cluster, which belong to
+// the first entry of the cluster after it
+void Filesys::SeedLongName(uint32_t cluster, LfnState& lfn)
+{
+  uint32_t entries = finfo_.ClusBytes >> 5;
+  uint32_t location = finfo_.GetClusPos(cluster);
+  uint8_t record[32];
+  uint32_t first = entries;
+
+  while (first > 0 && entries - first < LFN_MAX)
+  {
+    ReadRecord(record, location + 32 * (first - 1));
+    if ((record[11] & LONG) != LONG)
+      break;
+    --first;
+  }
+
+  for (uint32_t i = first; i < entries; ++i)
+  {
+    ReadRecord(record, location + 32 * i);
+    lfn.Feed(record, location + 32 * i);
+  }
+}
+
+// Decodes the entries of one directory cluster into list
+// if getDealloc is false, return only allocated files
+// if getDealloc is true, return only deallcoated files
+// Long names of allocated files are decoded too, onto the end of names,
+// prev is the cluster before this one in the directory, if any, where a
+// long name may start. Only reads the image, the pending records and the
+// FAT cache, so it is safe to call from several threads at once
+void Filesys::ReadClusEntries(uint32_t cluster, bool getDealloc,
+                              std::vector<DirEntry>& list, 
+                              std::string& names, uint32_t prev)
+{
+  uint32_t entries = finfo_.ClusBytes >> 5;
+  uint32_t location = finfo_.GetClusPos(cluster);
+  uint8_t record[32];
+  DirEntry entry;
+  LfnState lfn;
+  auto pending = pendingRecords_.lower_bound(location);
+
+  STAT_ADD(stats_, DIR_READS, 1);
+  lfn.Reset();
+  if (prev != 0 && !getDealloc)
+    SeedLongName(prev, lfn);
+
+  for (uint32_t i = 0; i < entries; ++i)
+  {
+    if (pending != pendingRecords_.end() && 
+        pending->first == location + (32 * i))
+    {
+      memcpy(record, pending->second.data(), 32);
+      ++pending;
+    }
+    else
+      ReadBytes(record, 32, location + (32 * i));
+
+    entry.attr = record[11];
+
+    // Freed long name records are free slots like any other
+    if ((entry.attr & LONG) == LONG && 
+        (!getDealloc || (record[0] != 0 && record[0] != DEALLOC)))
+    {
+      lfn.Feed(record, location + (32 * i));
+      continue;
+    }
+
+    if ((record[0] != 0 && record[0] != DEALLOC && !getDealloc) ||
+        ((record[0] == 0 || record[0] == DEALLOC) && getDealloc))
+    {
+      memcpy(entry.name, record, 11);
+      // Cluster number broken into two seperate integers, this 
+      // combines them into one integer
+      entry.clus = LoadLE<uint16_t>(record + 26) | 
+                   (uint32_t)LoadLE<uint16_t>(record + 20) << 16;
+      entry.size = LoadLE<uint32_t>(record + 28);
+      entry.entryLoc = location + (32 * i);
+      entry.lfnLoc = entry.entryLoc;
+      entry.longPos = 0;
+      entry.longLen = 0;
+
+      if (!getDealloc)
+        lfn.Match(record, entry, names);
+      list.push_back(entry);
+    }
+    lfn.Reset();
+  }
+}
+
+// Gets list of files in specified cluster
+// if getDealloc is false, return only allocated files
+// if getDealloc is true, return only deallcoated files
+Filesys::DirList Filesys::GetFileList(uint32_t cluster, bool getDealloc)
+{
+  STAT_TIME(stats_, GET_FILE_LIST);
+  uint32_t currentCluster = cluster;
+  uint32_t prevCluster = 0;
+  DirList list(*this);
+
+  // Loop through each entry and navigate to next clusters if necessary
+  do 
+  {
+    ReadClusEntries(currentCluster, getDealloc, list.entries_, list.names_,
+                    prevCluster);
+    prevCluster = currentCluster;
+    currentCluster = GetNextClus(currentCluster);
+  } while (currentCluster < FATEND);
+
+  return list;
+}
+
+// Returns the worker pool, starting it on first use
+WorkPool& Filesys::GetPool()
+{
+  std::call_once(poolOnce_, [this] { pool_ = new WorkPool(); });
+  return *pool_;
+}
+
+// Visits every entry below the directory at cluster, except . and .., in
+// no particular order. Every cluster of every directory is decoded as its
+// own task on the worker pool, visit must be safe to call from several 
+// workers at once. Returns false if part of the tree could not be read
+bool Filesys::WalkTree(uint32_t cluster, std::string path, 
+                       WalkVisitor visit)
+{
+  WorkPool& pool = GetPool();
+  std::vector<std::atomic<uint64_t>> seen(fat_.entries.size() / 64 + 1);
+  std::atomic<bool> failed(false);
+  std::function<void (uint32_t, std::string)> walkDir;
+
+  // Marks a directory as walked, so looping trees are walked once
+  auto firstVisit = [&seen] (uint32_t c) 
+  {
+    uint64_t bit = (uint64_t)1 << (c % 64);
+    return c / 64 < seen.size() && (seen[c / 64].fetch_or(bit) & bit) == 0;
+  };
+
+  auto walkClus = [&] (uint32_t c, uint32_t prev, std::string dirPath, 
+                       size_t worker)
+  {
+    std::vector<DirEntry> entries;
+    std::string names;
+
+    try
+    {
+      ReadClusEntries(c, false, entries, names, prev);
+    }
+    catch (std::exception &e)
+    {
+      failed = true;
+      return;
+    }
+
+    for (DirEntry& e : entries)
+    {
+      std::string name = e.GetShortName();
+      if (name == "." || name == ".." || (e.attr & VOLID) == VOLID)
+        continue;
+
+      name = e.GetName(names);
+      std::string entryPath = dirPath == "/" ? "/" + name :
+                              dirPath + "/" + name;
+      try
+      {
+        visit(worker, entryPath, e);
+      }
+      catch (std::exception &err)
+      {
+        failed = true;
+      }
+
+      if (e.IsDir() && e.clus >= 2 && firstVisit(e.clus))
+        walkDir(e.clus, entryPath);
+    }
+  };
+
+  walkDir = [&] (uint32_t dir, std::string dirPath)
+  {
+    uint32_t c = dir;
+    uint32_t prev = 0;
+    size_t limit = fat_.entries.size();
+
+    while (c >= 2 && c < FATEND && limit-- > 0)
+    {
+      pool.Submit([&walkClus, c, prev, dirPath] (size_t worker) 
+                  { walkClus(c, prev, dirPath, worker); });
+      try
+      {
+        prev = c;
+        c = GetNextClus(c);
+      }
+      catch (std::exception &e)
+      {
+        failed = true;
+        break;
+      }
+    }
+  };
+
+  firstVisit(cluster);
+  walkDir(cluster, path);
+  pool.Wait();
+
+  return !failed;
+}
+
+// Takes spare buffers from the arena
+Filesys::DirList::DirList(Filesys& owner) : owner_(&owner), entries_(), 
+                                            names_()
+{
+  static_assert(std::is_trivially_copyable<DirEntry>::value,
+                "Listings must not allocate per entry");
+
+  if (!dirArena_.empty())
+  {
+    entries_.swap(dirArena_.back().first);
+    names_.swap(dirArena_.back().second);
+    dirArena_.pop_back();
+  }
+}
+
+Filesys::DirList::DirList(DirList&& a) : owner_(a.owner_), entries_(), 
+                                         names_()
+{
+  entries_.swap(a.entries_);
+  names_.swap(a.names_);
+  a.owner_ = NULL;
+}
+
+Filesys::DirList& Filesys::DirList::operator=(DirList&& a)
+{
+  entries_.swap(a.entries_);
+  names_.swap(a.names_);
+  std::swap(owner_, a.owner_);
+  return *this;
+}
+
+// Hands the buffers back to the arena, keeping their capacity
+Filesys::DirList::~DirList()
+{
+  if (owner_ == NULL || entries_.capacity() == 0)
+    return;
+
+  entries_.clear();
+  names_.clear();
+  dirArena_.push_back(std::make_pair(std::vector<DirEntry>(), 
+                                     std::string()));
+  dirArena_.back().first.swap(entries_);
+  dirArena_.back().second.swap(names_);
+}
+
+std::vector<Filesys::DirEntry>::iterator Filesys::DirList::begin()
+{
+  return entries_.begin();
+}
+
+std::vector<Filesys::DirEntry>::iterator Filesys::DirList::end()
+{
+  return entries_.end();
+}
+
+Filesys::DirEntry& Filesys::DirList::front()
+{
+  return entries_.front();
+}
+
+size_t Filesys::DirList::size() const
+{
+  return entries_.size();
+}
+
+void Filesys::DirList::push_back(const DirEntry& entry)
+{
+  entries_.push_back(entry);
+}
+
+// Returns the long name of an entry of the list if it has one, the short
+// name otherwise
+std::string Filesys::DirList::GetName(const DirEntry& entry) const
+{
+  return entry.GetName(names_);
+}
+
+// Returns the cluster holding a byte location of the data region
+uint32_t Filesys::GetClusOfLoc(uint32_t loc)
+{
+  return ((loc - finfo_.DataPos) >> finfo_.ClusBytesShift) + 2;
+}
+
+// Returns the name index of a directory, reading it on first use
+Filesys::DirCache& Filesys::GetDirCache(uint32_t cluster)
+{
+  {
+    std::lock_guard<std::mutex> guard(cacheLock_);
+    std::unordered_map<uint32_t, DirCache>::iterator found = 
+          dirCache_.find(cluster);
+
+    if (found != dirCache_.end())
+    {
+      STAT_ADD(stats_, DIR_CACHE_HITS, 1);
+      return found->second;
+    }
+  }
+
+  STAT_ADD(stats_, DIR_CACHE_MISSES, 1);
+
+  // Readers may index the same directory at once, the first one to 
+  // finish keeps its copy
+  DirList list = GetFileList(cluster);
+  DirCache dir;
+
+  // The entries keep their places in the names of the list
+  dir.names = list.names_;
+  for (DirEntry& e : list)
+  {
+    std::string name = e.GetShortName();
+    if (dir.byName.insert(std::make_pair(name, e)).second)
+    {
+      dir.byLoc[e.entryLoc] = name;
+      if (e.longLen != 0)
+        dir.byLong.insert(std::make_pair(FoldName(e.GetLongName(dir.names)),
+                                         name));
+    }
+  }
+
+  uint32_t currentCluster = cluster;
+  do
+  {
+    dir.chain.push_back(currentCluster);
+    currentCluster = GetNextClus(currentCluster);
+  } while (currentCluster < FATEND);
+
+  std::lock_guard<std::mutex> guard(cacheLock_);
+  std::pair<std::unordered_map<uint32_t, DirCache>::iterator, bool> added =
+        dirCache_.insert(std::make_pair(cluster, DirCache()));
+
+  if (added.second)
+  {
+    added.first->second = std::move(dir);
+    for (uint32_t c : added.first->second.chain)
+      dirOfClus_[c] = cluster;
+  }
+  return added.first->second;
+}
+
+// Looks up an allocated entry by short name, or by long name in any
+// case, returns NULL if there is no such entry. names, if given, is set
+// to where the long name of the entry is kept. The pointers are only 
+// valid until the directory changes
+Filesys::DirEntry* Filesys::FindEntry(uint32_t cluster, std::string name,
+                                      const std::string** names)
+{
+  DirCache& dir = GetDirCache(cluster);
+  std::unordered_map<std::string, DirEntry>::iterator found = 
+        dir.byName.find(name);
+
+  if (found == dir.byName.end())
+  {
+    std::unordered_map<std::string, std::string>::iterator alias = 
+          dir.byLong.find(FoldName(name));
+
+    if (alias == dir.byLong.end())
+      return NULL;
+
+    found = dir.byName.find(alias->second);
+    if (found == dir.byName.end())
+      return NULL;
+  }
+
+  if (names != NULL)
+    *names = &dir.names;
+  return &(found->second);
+}
+
+// Drops the name index of a directory, used when its chain changes
+void Filesys::InvalidateDir(uint32_t cluster)
+{
+  std::lock_guard<std::mutex> guard(cacheLock_);
+  std::unordered_map<uint32_t, DirCache>::iterator found = 
+        dirCache_.find(cluster);
+
+  if (found == dirCache_.end())
+    return;
+
+  for (uint32_t c : found->second.chain)
+    dirOfClus_.erase(c);
+
+  dirCache_.erase(found);
+}
+
+// Brings the name index of the directory holding entry up to date
+void Filesys::UpdateDirCache(FileEntry& entry)
+{
+  std::lock_guard<std::mutex> guard(cacheLock_);
+  std::unordered_map<uint32_t, uint32_t>::iterator owner = 
+        dirOfClus_.find(GetClusOfLoc(entry.entryLoc));
+
+  if (owner == dirOfClus_.end())
+    return;
+
+  DirCache& dir = dirCache_[owner->second];
+  std::unordered_map<uint32_t, std::string>::iterator old = 
+        dir.byLoc.find(entry.entryLoc);
+  // An unchanged long name keeps its place in the names of the index
+  uint32_t longPos = dir.names.size();
+
+  if (old != dir.byLoc.end())
+  {
+    std::unordered_map<std::string, DirEntry>::iterator stale = 
+          dir.byName.find(old->second);
+
+    if (stale != dir.byName.end() && stale->second.longLen != 0)
+    {
+      std::string longName = stale->second.GetLongName(dir.names);
+
+      if (longName == entry.longName)
+        longPos = stale->second.longPos;
+      dir.byLong.erase(FoldName(longName));
+    }
+    dir.byName.erase(old->second);
+    dir.byLoc.erase(old);
+  }
+
+  if (entry.name[0] == 0 || (uint8_t)entry.name[0] == DEALLOC ||
+      (entry.attr & LONG) == LONG)
+    return;
+
+  if (longPos == dir.names.size())
+    dir.names += entry.longName;
+
+  DirEntry record;
+  memset(record.name, ' ', 11);
+  memcpy(record.name, entry.name.data(), std::min<size_t>(11, 
+                                                   entry.name.length()));
+  record.attr = entry.attr;
+  record.clus = entry.clus;
+  record.size = entry.size;
+  record.entryLoc = entry.entryLoc;
+  record.lfnLoc = entry.lfnLoc;
+  record.longPos = longPos;
+  record.longLen = entry.longName.length();
+
+  std::string name = record.GetShortName();
+  if (dir.byName.insert(std::make_pair(name, record)).second)
+  {
+    dir.byLoc[entry.entryLoc] = name;
+    if (record.longLen != 0)
+      dir.byLong.insert(std::make_pair(FoldName(entry.longName), name));
+  }
+}
+
+// Reads from filesystem into data
+template <typename T>
+void Filesys::ReadValue(T* data, size_t len, size_t pos, 
+     size_t width)
+{
+  if (width * len + pos > filesys_size_)
+    throw std::exception();
+
+  STAT_ADD(stats_, BYTES_READ, width * len);
+
+  // Fields stored at their native width need no assembling
+  if (width == sizeof(T) && HOST_IS_LE)
+  {
+    storage_->Read(data, len * sizeof(T), pos);
+    return;
+  }
+
+  std::vector<uint8_t> bytes(width * len);
+  storage_->Read(bytes.data(), bytes.size(), pos);
+
+  if (width == sizeof(T))
+  {
+    for (size_t i = 0; i < len; ++i)
+      data[i] = LoadLE<T>(&bytes[i * sizeof(T)]);
+    return;
+  }
+
+  for (size_t i = 0; i < len; ++i)
+  {
+    data[i] = 0;
+    for (size_t p = 0; p < width; ++p)
+      data[i] |= bytes[(i * width) + p] << (8 * p);
+  }
+}
+
+// Writes from data to filesystem
+template <typename T>
+void Filesys::WriteValue(T* data, size_t len, size_t pos, 
+                         size_t width)
+{
+  T tData;
+  T mask = 0xFF;
+
+  if (width * len + pos > filesys_size_)
+    throw std::exception();
+
+  if (width == sizeof(T) && HOST_IS_LE)
+  {
+    storage_->Write(data, len * sizeof(T), pos);
+    return;
+  }
+
+  std::vector<uint8_t> bytes(width * len);
+
+  for (size_t i = 0; i < len; ++i)
+  {
+    tData = data[i];
+    for (size_t p = 0; p < width; ++p)
+    {
+      bytes[(i * width) + p] = (uint8_t)(tData & mask);
+      tData = tData >> 8;
+    }
+  }
+
+  storage_->Write(bytes.data(), bytes.size(), pos);
+}
+
+// Copies a byte stream out of the filesystem
+void Filesys::ReadBytes(void* data, size_t len, size_t pos)
+{
+  if (len + pos > filesys_size_)
+    throw std::exception();
+
+  STAT_ADD(stats_, BYTES_READ, len);
+  storage_->Read(data, len, pos);
+}
+
+// Copies a byte stream into the filesystem
+void Filesys::WriteBytes(const void* data, size_t len, size_t pos)
+{
+  if (len + pos > filesys_size_)
+    throw std::exception();
+
+  STAT_ADD(stats_, BYTES_WRITTEN, len);
+  storage_->Write(data, len, pos);
+}
+
+// Sets a range of the filesystem to value
+void Filesys::FillBytes(uint8_t value, size_t len, size_t pos)
+{
+  if (len + pos > filesys_size_)
+    throw std::exception();
+
+  STAT_ADD(stats_, BYTES_WRITTEN, len);
+  storage_->Fill(value, len, pos);
+}
+
+// Hands span to visit in pieces. Mapped images are handed out in place,
+// otherwise each piece is read into a buffer first. Returns false as soon
+// as visit does
+bool Filesys::VisitSpan(const Span& span, 
+                        std::function<bool (const uint8_t*, size_t)> visit)
+{
+  if (mFilesys_ != NULL)
+    return visit(mFilesys_ + span.pos, span.len);
+
+  std::vector<uint8_t> buffer(std::min<size_t>(span.len, COPY_CHUNK));
+
+  for (size_t done = 0; done < span.len; done += buffer.size())
+  {
+    size_t piece = std::min(buffer.size(), span.len - done);
+    ReadBytes(buffer.data(), piece, span.pos + done);
+    if (!visit(buffer.data(), piece))
+      return false;
+  }
+  return true;
+}
+
+// Maps a byte range of file onto spans of the filesystem image, one per 
+// run of contiguous clusters. Returns false if start is past the chain
+bool Filesys::MapFileRange(FileEntry& file, uint32_t start, 
+                           uint32_t length, std::vector<Span>& spans)
+{
+  uint32_t clusSize = finfo_.ClusBytes;
+
+  uint32_t clusNum = start >> finfo_.ClusBytesShift;
+  uint32_t clusOffset = start & (clusSize - 1);
+
+  if (!file.extentsValid)
+    BuildExtents(file);
+
+  std::vector<Extent>::iterator ext = file.FindExtent(clusNum);
+
+  if (ext == file.extents.end())
+    return false;
+
+  uint32_t amountTran = 0;
+
+  while (amountTran < length && ext != file.extents.end())
+  {
+    uint32_t skip = clusNum - ext->index;
+    uint64_t remaining = (uint64_t)(ext->length - skip) * clusSize - 
+                         clusOffset;
+    uint32_t tran = length - amountTran;
+
+    if (tran > remaining)
+      tran = remaining;
+
+    Span span;
+    span.pos = finfo_.GetClusPos(ext->start + skip) + clusOffset;
+    span.len = tran;
+
+    if (span.pos + span.len > filesys_size_)
+      throw std::exception();
+
+    spans.push_back(span);
+    amountTran += tran; 
+    clusOffset = 0;
+    clusNum = ext->index + ext->length;
+    ++ext;
+  }
+  return true;
+}
+
+// Detects sequential reads of an open file and asks the kernel to fault in
+// the clusters that follow. The window doubles while reads stay
+// sequential and is dropped as soon as one is not
+void Filesys::ReadAhead(Handle& handle, uint32_t start, uint32_t length)
+{
+  if (start == handle.raNext)
+  {
+    handle.raWindow = handle.raWindow == 0 ? READAHEAD_MIN : 
+                      handle.raWindow * 2;
+    if (handle.raWindow > READAHEAD_MAX)
+      handle.raWindow = READAHEAD_MAX;
+  }
+  else
+    handle.raWindow = 0;
+
+  handle.raNext = start + length;
+
+  if (handle.raWindow == 0 || length == 0)
+    return;
+
+  std::vector<Span> spans;
+
+  if (!MapFileRange(handle.open->file, handle.raNext, 
+                    handle.raWindow << finfo_.ClusBytesShift, spans))
+    return;
+
+  for (Span& span : spans)
+    storage_->WillNeed(span.pos, span.len);
+}
+
+// Writes or reads a file depending on mode, READ or WRITE
+// Assumes that memory has been allocated for it
+uint32_t Filesys::FileOperate(char* stream, uint32_t start, 
+     uint32_t length, FileEntry& file, uint32_t mode)
+{
+  STAT_TIME(stats_, FILE_OPERATE);
+  std::vector<Span> spans;
+
+  if (!MapFileRange(file, start, length, spans))
+  {
+    Fail() << "Error: Start Parameter out of bounds"
+           << '\n';
+    return 0;
+  }
+
+  uint32_t amountTran = 0;
+
+  for (Span& span : spans)
+  {
+    if (mode == WRITE)
+      WriteBytes(stream + amountTran, span.len, span.pos);
+    else
+      ReadBytes(stream + amountTran, span.len, span.pos);
+
+    amountTran += span.len;
+  }
+  return amountTran;
+}
+
+// Returns pointers straight into the mapped image for a range of a file
+// open in session, so callers can writev them without copying. The spans stay valid
+// until the file is written to or the filesystem is closed. Returns false
+// if the backend does not map the image
+bool Filesys::ReadExtents(std::string name, uint32_t start, 
+                          uint32_t length, std::vector<struct iovec>& out,
+                          Session* session)
+{
+  Scope scope(*this, session, true);
+  Handle* handle = GetHandle(FindHandle(Current().cwd, name));
+
+  if (handle == NULL || (handle->openInfo & READ) != READ || 
+      mFilesys_ == NULL)
+    return false;
+
+  std::vector<Span> spans;
+  std::lock_guard<std::mutex> guard(handle->open->lock);
+
+  if (!MapFileRange(handle->open->file, start, length, spans))
+    return false;
+
+  ReadAhead(*handle, start, length);
+
+  for (Span& span : spans)
+  {
+    struct iovec vec;
+    vec.iov_base = mFilesys_ + span.pos;
+    vec.iov_len = span.len;
+    out.push_back(vec);
+  }
+  return true;
+}
+
+// Returns next cluster in the file from the cached FAT
+uint32_t Filesys::GetNextClus(uint32_t cluster)
+{
+  STAT_ADD(stats_, NEXT_CLUS, 1);
+  if (cluster >= fat_.entries.size())
+    throw std::exception();
+
+  return fat_.entries[cluster] & FATMASK;
+}
+
+// Sets cluster in the cached FAT, fatLoc specfies the cluster. Every FAT
+// copy picks it up at the next flush
+void Filesys::SetNextClus(uint32_t fatLoc, uint32_t value)
+{
+  STAT_TIME(stats_, SET_NEXT_CLUS);
+  if (fatLoc >= fat_.entries.size())
+    throw std::exception();
+
+  uint32_t entry = (fat_.entries[fatLoc] & (~FATMASK)) | (value & FATMASK);
+  fat_.Set(fatLoc, entry);
+
+  // Open files whose chain runs through this cluster must be reindexed
+  for (OpenFile& open : openFiles_)
+  {
+    FileEntry& e = open.file;
+    if (e.extentsValid && e.ChainContains(fatLoc))
+      e.extentsValid = false;
+  }
+
+  MarkFatDirty(fatLoc, 1);
+}
+
+// Updates a cached entry and keeps the free bitmap in step
+void Filesys::FatCache::Set(uint32_t cluster, uint32_t value)
+{
+  entries[cluster] = value;
+
+  if (cluster < 2 || cluster >= endOfFat)
+    return;
+
+  if ((value & FATMASK) == 0)
+    freeMap[cluster / 64] |= (uint64_t)1 << (cluster % 64);
+  else
+    freeMap[cluster / 64] &= ~((uint64_t)1 << (cluster % 64));
+}
+
+// Returns the first free cluster in [from, end), or 0 if there is none
+uint32_t Filesys::FatCache::FindFreeIn(uint32_t from, uint32_t end)
+{
+  size_t limit = std::min<size_t>(end, freeMap.size() * 64);
+  size_t found = FatMapFindSet(freeMap.data(), from, limit);
+
+  return found < limit ? found : 0;
+}
+
+// Returns the first free cluster at or after hint, wrapping around to
+// cluster 2. Returns 0 if the filesystem is full
+uint32_t Filesys::FatCache::FindFree(uint32_t hint)
+{
+  if (hint < 2 || hint >= endOfFat)
+    hint = 2;
+
+  uint32_t found = FindFreeIn(hint, endOfFat);
+
+  if (found == 0)
+    found = FindFreeIn(2, hint);
+
+  return found;
+}
+
+// Counts the free clusters starting at cluster, stopping at max
+uint32_t Filesys::FatCache::RunLength(uint32_t cluster, uint32_t max)
+{
+  if (cluster >= endOfFat)
+    return 0;
+
+  size_t stop = std::min<uint64_t>((uint64_t)cluster + max, endOfFat);
+  return FatMapFindClear(freeMap.data(), cluster, stop) - cluster;
+}
+
+// Returns the start of the first run of count free clusters at or after
+// hint, wrapping around to cluster 2. Returns 0 if there is no such run
+uint32_t Filesys::FatCache::FindRun(uint32_t count, uint32_t hint)
+{
+  if (hint < 2 || hint >= endOfFat)
+    hint = 2;
+
+  for (int pass = 0; pass < 2; ++pass)
+  {
+    uint32_t end = pass == 0 ? endOfFat : hint;
+    uint32_t cluster = pass == 0 ? hint : 2;
+
+    while ((cluster = FindFreeIn(cluster, end)) != 0)
+    {
+      uint32_t length = RunLength(cluster, count);
+      if (length >= count)
+        return cluster;
+      cluster += length;
+    }
+  }
+
+  return 0;
+}
+
+// Picks count free clusters without claiming them, as one run if one is
+// long enough, otherwise as the free runs found going on from hint.
+// Returns false if the filesystem does not have count free clusters
+bool Filesys::FatCache::Reserve(uint32_t count, uint32_t hint,
+                                std::vector<Extent>& runs)
+{
+  runs.clear();
+
+  uint32_t start = FindRun(count, hint);
+  if (start != 0)
+  {
+    Extent run = { 0, start, count };
+    runs.push_back(run);
+    return true;
+  }
+
+  if (hint < 2 || hint >= endOfFat)
+    hint = 2;
+
+  uint32_t total = 0;
+
+  for (int pass = 0; pass < 2 && total < count; ++pass)
+  {
+    uint32_t end = pass == 0 ? endOfFat : hint;
+    uint32_t cluster = pass == 0 ? hint : 2;
+
+    while (total < count && (cluster = FindFreeIn(cluster, end)) != 0)
+    {
+      uint32_t length = RunLength(cluster, count - total);
+      Extent run = { total, cluster, length };
+      runs.push_back(run);
+      total += length;
+      cluster += length;
+    }
+  }
+
+  if (total < count)
+  {
+    runs.clear();
+    return false;
+  }
+  return true;
+}
+
+// Chains a run of clusters to one another and ends it with next, writing
+// each FAT copy in one go. The clusters must not be part of an open file
+void Filesys::LinkRun(uint32_t start, uint32_t length, uint32_t next)
+{
+  if (length == 0 || start + length > fat_.entries.size())
+    throw std::exception();
+
+  for (uint32_t i = 0; i < length; ++i)
+  {
+    uint32_t value = i == length - 1 ? next : start + i + 1;
+    fat_.Set(start + i, (fat_.entries[start + i] & (~FATMASK)) | 
+                        (value & FATMASK));
+  }
+
+  MarkFatDirty(start, length);
+}
+
+// Frees the chains starting at each of firsts, clearing each contiguous
+// run of a chain in one go and adjusting the free count once for all of
+// them. A chain stops early at a cluster that is already free, so chains
+// sharing clusters are only counted once. The chains must not be part of
+// an open file. Returns the number of clusters freed
+uint32_t Filesys::FreeChains(const std::vector<uint32_t>& firsts)
+{
+  size_t size = fat_.entries.size();
+  size_t budget = size;
+  uint32_t freed = 0;
+
+  auto inChain = [this, size] (uint32_t c)
+  {
+    return c >= 2 && c < size && (fat_.entries[c] & FATMASK) != 0;
+  };
+
+  for (uint32_t c : firsts)
+  {
+    while (inChain(c) && budget > 0)
+    {
+      uint32_t start = c;
+      uint32_t length = 0;
+
+      do
+      {
+        c = fat_.entries[c] & FATMASK;
+        ++length;
+        --budget;
+      } while (c == start + length && inChain(c) && budget > 0);
+
+      for (uint32_t i = start; i < start + length; ++i)
+        fat_.Set(i, fat_.entries[i] & (~FATMASK));
+
+      MarkFatDirty(start, length);
+      freed += length;
+    }
+  }
+
+  if (freed != 0)
+    UpdateClusCount([freed] (uint32_t value) { return value + freed; });
+  STAT_ADD(stats_, CLUS_FREED, freed);
+
+  return freed;
+}
+
+void Filesys::UpdateClusCount(std::function<uint32_t (uint32_t)> op)
+{
+  fat_.freeCount = op(fat_.freeCount);
+  fat_.dirty = true;
+}
+
+// Indicates where to begin looking for empty clusters in the FAT
+uint32_t Filesys::GetFATNxtFree()
+{
+  uint32_t value;
+  ReadValue(&value, 1, finfo_.BytesPerSec * finfo_.FsInfo + 492, 4);
+
+  return value;
+}
+
+// Calculates number of free clusters from FsInfo section 
+uint32_t Filesys::GetNFreeClus()
+{
+  uint32_t value;
   ReadValue(&value, 1, finfo_.FsInfo * finfo_.BytesPerSec + 488, 4);
   return value;
 }
 
-// Sets number of free clusters from FsInfo section 
-void Filesys::SetNFreeClus(uint32_t value)
+// Returns the base 2 logarithm of a power of two
+static uint32_t Log2(uint32_t value)
+{
+  uint32_t shift = 0;
+
+  while ((value >> shift) > 1)
+    ++shift;
+  return shift;
+}
+
+// Derives the shifts used for addressing from the sizes Validate checked
+void Filesys::Fat32Info::SetGeometry()
+{
+  SecShift = Log2(BytesPerSec);
+  ClusShift = Log2(SecPerClus);
+  ClusBytesShift = SecShift + ClusShift;
+  ClusBytes = (uint32_t)1 << ClusBytesShift;
+  DataPos = (uint64_t)FirstDataSec << SecShift;
+}
+
+// Calculation found on page 14 of specification
+uint32_t Filesys::Fat32Info::GetFirstSectorOfClus(uint32_t n)
+{
+  return ((n - 2) << ClusShift) + FirstDataSec; 
+}
+
+// Byte position of the start of cluster n in the image
+uint64_t Filesys::Fat32Info::GetClusPos(uint32_t n)
+{
+  return DataPos + ((uint64_t)(n - 2) << ClusBytesShift);
+}
+
+// Calculation found on page 15 of specification
+uint32_t Filesys::Fat32Info::GetThisFatSecN(uint32_t n)
+{
+  return RsvdSecCnt + ((n * 4) >> SecShift);
+}
+
+// Calculation found on page 15 of specification
+uint32_t Filesys::Fat32Info::GetThisFatEntOff(uint32_t n)
+{
+  return (n * 4) & (BytesPerSec - 1);
+}
+
+// Gets the end of fat
+uint32_t Filesys::Fat32Info::GetEndOfFat()
+{
+  return ((TotSec - FirstDataSec) >> ClusShift) + 1;
+}
+
+Filesys::FileEntry::FileEntry(const DirEntry& d, const std::string& l) :
+                            name(d.name, strnlen(d.name, 11)), attr(d.attr),
+                            lo(d.clus & 0x0000FFFF), hi(d.clus >> 16), 
+                            wrtTime(), wrtDate(), size(d.size), 
+                            clus(d.clus), entryLoc(d.entryLoc), 
+                            lfnLoc(d.lfnLoc), longName(l), 
+                            extentsValid(false), extents(), extentOrder(),
+                            tail(0), clusCount(0)
+{
+}
+
+Filesys::FileEntry::FileEntry(const FileEntry& a) :
+                            name(a.name), attr(a.attr), lo(a.lo), 
+                            hi(a.hi), size(a.size), clus(a.clus), 
+                            entryLoc(a.entryLoc), lfnLoc(a.lfnLoc), 
+                            longName(a.longName), 
+                            extentsValid(a.extentsValid), 
+                            extents(a.extents), extentOrder(a.extentOrder),
+                            tail(a.tail), clusCount(a.clusCount)
+{
+  // Cluster number broken into two seperate integers, this combines
+  // them into one integer
+  clus = lo;
+  clus |= hi << 16;
+}
+
+// Turns short name into lowercase format
+// Ex "FILE   PDF" -> "file.pdf"
+static std::string FormatShortName(const char* name, size_t length)
+{
+  std::string newName, postfix;
+
+  for (size_t i = 0; i < length && i < 8; ++i)
+  {
+    if (name[i] != ' ')
+      newName.push_back(name[i]);
+  }
+
+  for (size_t i = 8; i < length && i < 11; ++i)
+  {
+    if (name[i] != ' ')
+      postfix.push_back(name[i]);
+  }
+
+  if (postfix.length() != 0)
+    newName += "." + postfix;
+
+  std::transform(newName.begin(), newName.end(), newName.begin(), 
+                  ::tolower);
+  return newName;
+}
+
+std::string Filesys::FileEntry::GetShortName()
+{
+  return FormatShortName(name.data(), name.length());
+}
+
+// Returns the long name if there is one, the short name otherwise
+std::string Filesys::FileEntry::GetName()
+{
+  return longName.empty() ? GetShortName() : longName;
+}
+
+// Returns true if name is the short name or, in any case, the long name
+bool Filesys::FileEntry::HasName(const std::string& other)
+{
+  return GetShortName() == other || 
+         (!longName.empty() && FoldName(longName) == FoldName(other));
+}
+
+// Returns the long name kept in names, empty if there is none
+std::string Filesys::DirEntry::GetLongName(const std::string& names) const
+{
+  return longLen == 0 ? std::string() : names.substr(longPos, longLen);
+}
+
+// Returns the long name kept in names if there is one, the short name 
+// otherwise
+std::string Filesys::DirEntry::GetName(const std::string& names) const
+{
+  return longLen == 0 ? GetShortName() : names.substr(longPos, longLen);
+}
+
+void Filesys::LfnState::Reset()
+{
+  chars.clear();
+  loc = 0;
+  sum = 0;
+  next = 0;
+}
+
+// Takes the next record of a long name, found at loc. Records must come
+// last part first with matching checksums, anything else starts over
+void Filesys::LfnState::Feed(const uint8_t* record, uint32_t at)
+{
+  static const uint8_t offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 
+                                       24, 28, 30 };
+  uint8_t order = record[0] & 0x1F;
+
+  if (record[0] == 0 || record[0] == DEALLOC || order == 0 || 
+      order > LFN_MAX)
+  {
+    Reset();
+    return;
+  }
+
+  if ((record[0] & LFN_LAST) == LFN_LAST)
+  {
+    Reset();
+    chars.assign(order * 13, 0xFFFF);
+    sum = record[13];
+    loc = at;
+  }
+  else if (chars.empty() || order != next || record[13] != sum)
+  {
+    Reset();
+    return;
+  }
+
+  for (size_t k = 0; k < 13; ++k)
+    chars[(order - 1) * 13 + k] = LoadLE<uint16_t>(record + offsets[k]);
+  next = order - 1;
+}
+
+// Hands the long name to entry, decoded onto the end of names, if every
+// record of it was seen and it belongs to the short name of record
+bool Filesys::LfnState::Match(const uint8_t* record, DirEntry& entry,
+                              std::string& names)
+{
+  if (chars.empty() || next != 0 || ShortNameSum(record) != sum)
+    return false;
+
+  size_t start = names.length();
+  EncodeUtf8(chars, names);
+  if (names.length() == start)
+    return false;
+
+  entry.longPos = start;
+  entry.longLen = names.length() - start;
+  entry.lfnLoc = loc;
+  return true;
+}
+
+std::string Filesys::DirEntry::GetShortName() const
+{
+  return FormatShortName(name, strnlen(name, 11));
+}
+
+// Returns true if entry is a directory
+bool Filesys::DirEntry::IsDir() const
+{
+  return (attr & DIRECT) == DIRECT;
+}
+
+// Returns true if entry is a directory
+bool Filesys::FileEntry::IsDir()
+{
+  if ((attr & DIRECT) == DIRECT) 
+    return true;
+  else
+    return false;
+}
+
+// Sets the time field
+void Filesys::FileEntry::SetCurrentTime()
+{
+  time_t timer;
+  struct tm* localTime;
+
+  time(&timer);
+  localTime = localtime(&timer);
+  
+  wrtDate = localTime->tm_mday;
+  wrtDate |= ((localTime->tm_mon + 1) << 5);
+  wrtDate |= ((localTime->tm_year - 80) << 9);
+
+  uint8_t tValue = localTime->tm_sec / 2;
+  wrtTime = tValue > 29 ? 29 : tValue;
+  wrtTime |= (localTime->tm_min << 5);
+  wrtTime |= (localTime->tm_hour << 11);
+}
+
+// Sets the Cluster information for the file entry
+void Filesys::FileEntry::SetClus(uint32_t cluster)
+{
+  clus = cluster;
+  extentsValid = false;
+  hi = (cluster & 0xFFFF0000) >> 16;
+  lo = cluster & 0x0000FFFF;
+}
+
+// Returns true if cluster is part of the indexed chain
+bool Filesys::FileEntry::ChainContains(uint32_t cluster)
+{
+  // extentOrder holds extent positions sorted by their start cluster
+  std::vector<uint32_t>::iterator pos = std::upper_bound(
+        extentOrder.begin(), extentOrder.end(), cluster,
+        [this] (uint32_t c, uint32_t e) { return c < extents[e].start; });
+
+  if (pos == extentOrder.begin())
+    return false;
+
+  Extent& ext = extents[*(pos - 1)];
+  return cluster < ext.start + ext.length;
+}
+
+// Returns the extent holding the cluster index, or end if the chain is
+// shorter than that
+std::vector<Filesys::Extent>::iterator 
+Filesys::FileEntry::FindExtent(uint32_t index)
+{
+  std::vector<Extent>::iterator pos = std::upper_bound(
+        extents.begin(), extents.end(), index,
+        [] (uint32_t i, const Extent& e) { return i < e.index; });
+
+  if (pos == extents.begin())
+    return extents.end();
+
+  --pos;
+  if (index - pos->index >= pos->length)
+    return extents.end();
+
+  return pos;
+}
+
+// Adds a run of clusters after the tail of the indexed chain
+void Filesys::FileEntry::AppendRun(uint32_t start, uint32_t length)
+{
+  if (!extents.empty() && tail + 1 == start)
+  {
+    extents.back().length += length;
+  }
+  else
+  {
+    Extent ext = { clusCount, start, length };
+    extents.push_back(ext);
+
+    std::vector<uint32_t>::iterator pos = std::upper_bound(
+          extentOrder.begin(), extentOrder.end(), start,
+          [this] (uint32_t c, uint32_t e) { return c < extents[e].start; });
+    extentOrder.insert(pos, extents.size() - 1);
+  }
+
+  clusCount += length;
+  tail = start + length - 1;
+}
+
+// Breaks up address into list of locations, in lower case unless 
+// keepCase is set
+// Ex /exdir/test/file -> list {exdir, test, file}
+std::list<std::string> Filesys::ParseAddress(std::string add, bool keepCase)
+{
+  std::list<std::string> list;
+  if (add.size() != 0)
+  {
+    size_t start = 0;
+    size_t end;
+    
+    if (!keepCase)
+      std::transform(add.begin(), add.end(), add.begin(), ::tolower);
+
+    if (add[0] == '/')
+    {
+      list.push_back("/");
+      start = 1;
+    }
+
+    while((end = add.find_first_of("/", start)) != 
+                                                 std::string::npos)
+    {
+      if (start - end != 0)
+      {
+          list.push_back(add.substr(start, end - start));
+      }
+
+      start = end + 1;
+    }
+
+    if (start < add.size())
+      list.push_back(add.substr(start));
+  }
+
+  return list;
+}
+
+// Finds a resolved path in the path cache and marks it as recently used
+bool Filesys::LookupPath(const std::string& key, uint32_t& cluster)
+{
+  std::lock_guard<std::mutex> guard(pathLock_);
+  std::unordered_map<std::string, 
+       std::list<std::pair<std::string, uint32_t>>::iterator>::iterator 
+       found = pathIndex_.find(key);
+
+  if (found == pathIndex_.end())
+  {
+    STAT_ADD(stats_, PATH_CACHE_MISSES, 1);
+    return false;
+  }
+
+  STAT_ADD(stats_, PATH_CACHE_HITS, 1);
+  pathLru_.splice(pathLru_.begin(), pathLru_, found->second);
+  cluster = found->second->second;
+  return true;
+}
+
+// Remembers a resolved path, evicting the least recently used one when full
+void Filesys::CachePath(const std::string& key, uint32_t cluster)
+{
+  std::lock_guard<std::mutex> guard(pathLock_);
+  std::unordered_map<std::string, 
+       std::list<std::pair<std::string, uint32_t>>::iterator>::iterator 
+       found = pathIndex_.find(key);
+
+  if (found != pathIndex_.end())
+  {
+    pathLru_.splice(pathLru_.begin(), pathLru_, found->second);
+    pathLru_.front().second = cluster;
+    return;
+  }
+
+  if (pathLru_.size() >= PATHCACHE_SIZE)
+  {
+    pathIndex_.erase(pathLru_.back().first);
+    pathLru_.pop_back();
+  }
+
+  pathLru_.push_front(std::make_pair(key, cluster));
+  pathIndex_[key] = pathLru_.begin();
+}
+
+// Forgets every resolved path, used whenever directories change
+void Filesys::InvalidatePaths()
+{
+  std::lock_guard<std::mutex> guard(pathLock_);
+  pathLru_.clear();
+  pathIndex_.clear();
+  parentOf_.clear();
+}
+
+// Takes list of locations from ParseAddress and returns the cluster
+// of the final location. Start and end specifices the range in the 
+// list to navigate. End is not inclusive, start is inclusive
+uint32_t Filesys::NavToDir(std::list<std::string>& list, size_t start, 
+                           size_t end)
+{
+  STAT_TIME(stats_, NAV_TO_DIR);
+  uint32_t currDirClus = Current().cwd;
+
+  // Nowhere to navigate
+  if (start - end == 0)
+    return currDirClus;
+
+  // Nowhere to navigate
+  if (list.size() == 0)
+    throw std::exception();
+
+  std::vector<std::string> items;
+  size_t i = start;
+  for (std::string& item : list)
+  {
+    if (i == end)
+      break;
+    items.push_back(item);
+    ++i;
+  }
+
+  size_t first = 0;
+  if (start == 0 && items[0] == "/")
+  {
+    // Start at root
+    currDirClus = finfo_.RootClus;
+    first = 1;
+  }
+
+  // Cache keys are the starting cluster followed by each prefix of the
+  // path, so relative and absolute lookups of a directory share entries
+  std::vector<std::string> keys;
+  std::ostringstream key;
+  key << currDirClus;
+  keys.push_back(key.str());
+  for (size_t k = first; k < items.size(); ++k)
+    keys.push_back(keys.back() + "/" + items[k]);
+
+  // Resume from the longest prefix that has been resolved before
+  size_t done = 0;
+  for (size_t k = keys.size() - 1; k > 0; --k)
+  {
+    if (LookupPath(keys[k], currDirClus))
+    {
+      done = k;
+      break;
+    }
+  }
+
+  for (size_t k = first + done; k < items.size(); ++k)
+  {
+    std::string& item = items[k];
+
+    if (item != "." || currDirClus != finfo_.RootClus)
+    {
+      // Will not enter here if . and in root dir because there is no
+      // . in that directory
+      const std::string* names;
+      DirEntry* e = FindEntry(currDirClus, item, &names);
+
+      if (e == NULL || !e->IsDir())
+      {
+        throw std::exception();
+      }
+
+      // .. in level below root has clus of 0
+      if (e->clus == 0 && item == "..")
+        currDirClus = finfo_.RootClus;
+      else
+      {
+        if (item != "." && item != "..")
+        {
+          std::lock_guard<std::mutex> guard(pathLock_);
+          parentOf_[e->clus] = std::make_pair(currDirClus, 
+                                              e->GetName(*names));
+        }
+        currDirClus = e->clus;
+      }
+    }
+    CachePath(keys[k - first + 1], currDirClus);
+  }
+  return currDirClus;
+}
+
+// Gets the parent and name of directory clus, from the parent cache or
+// else from its .. entry. Returns false if it has none
+bool Filesys::FindParent(uint32_t clus, 
+                         std::pair<uint32_t, std::string>& link)
+{
+  {
+    std::lock_guard<std::mutex> guard(pathLock_);
+    std::unordered_map<uint32_t, std::pair<uint32_t, std::string>>::
+        iterator found = parentOf_.find(clus);
+
+    if (found != parentOf_.end())
+    {
+      link = found->second;
+      return true;
+    }
+  }
+
+  DirEntry* up = FindEntry(clus, "..");
+
+  if (up == NULL)
+    return false;
+
+  uint32_t parent = up->clus == 0 ? finfo_.RootClus : up->clus;
+  DirList list = GetFileList(parent);
+
+  for (DirEntry& e : list)
+  {
+    std::string shortName = e.GetShortName();
+
+    if (e.clus == clus && shortName != "." && shortName != "..")
+    {
+      link = std::make_pair(parent, list.GetName(e));
+
+      std::lock_guard<std::mutex> guard(pathLock_);
+      parentOf_[clus] = link;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Gets the path name to a cluster
+std::string Filesys::GenPathName(uint32_t clus)
+{
+  std::string name;
+  uint32_t curClus = clus;
+  size_t depth = 0;
+  std::pair<uint32_t, std::string> link;
+
+  // The depth check stops a corrupt tree with a loop in it
+  while (curClus != finfo_.RootClus && depth++ < fat_.entries.size())
+  {
+    if (!FindParent(curClus, link))
+      break;
+
+    if (name.length() == 0)
+      name = link.second;
+    else
+      name = link.second + "/" + name;
+    curClus = link.first;
+  }
+
+  return "/" + name;
+}
+
+// Walks the chain of file once and records it as runs of contiguous
+// clusters
+void Filesys::BuildExtents(FileEntry& file)
+{
+  uint32_t curClus = file.clus;
+  uint32_t index = 0;
+  size_t limit = fat_.entries.size();
+
+  file.extents.clear();
+  file.extentOrder.clear();
+
+  while (curClus >= 2 && curClus < FATEND && index < limit)
+  {
+    if (!file.extents.empty() && 
+        file.extents.back().start + file.extents.back().length == curClus)
+    {
+      ++file.extents.back().length;
+    }
+    else
+    {
+      Extent ext = { index, curClus, 1 };
+      file.extents.push_back(ext);
+    }
+
+    file.tail = curClus;
+    curClus = GetNextClus(curClus);
+    ++index;
+  }
+
+  file.clusCount = index;
+  if (index == 0)
+    file.tail = 0;
+
+  for (uint32_t i = 0; i < file.extents.size(); ++i)
+    file.extentOrder.push_back(i);
+
+  std::sort(file.extentOrder.begin(), file.extentOrder.end(),
+        [&file] (uint32_t a, uint32_t b) 
+        { return file.extents[a].start < file.extents[b].start; });
+
+  file.extentsValid = true;
+}
+
+// Returns the location of the record after loc in its directory, 0 if
+// loc is the last record of the chain
+uint32_t Filesys::NextRecordLoc(uint32_t loc)
+{
+  uint32_t cluster = GetClusOfLoc(loc);
+  uint32_t end = finfo_.GetClusPos(cluster) + finfo_.ClusBytes;
+
+  if (loc + 32 < end)
+    return loc + 32;
+
+  cluster = GetNextClus(cluster);
+  if (cluster < 2 || cluster >= FATEND)
+    return 0;
+
+  return finfo_.GetClusPos(cluster);
+}
+
+// Queues the long name records between lfnLoc and the entry, or marks
+// them free along with the entry
+void Filesys::SaveLongName(FileEntry& entry)
+{
+  static const uint8_t offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 
+                                       24, 28, 30 };
+  std::vector<uint16_t> chars;
+  uint8_t alias[11];
+  std::array<uint8_t, 32> record;
+  bool deleted = entry.name.empty() || (uint8_t)entry.name[0] == DEALLOC;
+
+  DecodeUtf8(entry.longName, chars);
+  uint32_t count = (chars.size() + 12) / 13;
+
+  // Past the end of the name comes one terminator, then padding
+  if (chars.size() % 13 != 0)
+    chars.push_back(0);
+  chars.resize(count * 13, 0xFFFF);
+
+  memset(alias, ' ', 11);
+  memcpy(alias, entry.name.data(), std::min<size_t>(11, entry.name.length()));
+  uint8_t sum = ShortNameSum(alias);
+  uint32_t loc = entry.lfnLoc;
+
+  for (uint32_t n = 0; loc != 0 && loc != entry.entryLoc && n < LFN_MAX; 
+       ++n)
+  {
+    ReadRecord(record.data(), loc);
+
+    if (deleted)
+      record[0] = DEALLOC;
+    else if (n < count)
+    {
+      uint8_t order = count - n;
+
+      memset(record.data(), 0, 32);
+      record[0] = order | (n == 0 ? LFN_LAST : 0);
+      record[11] = LONG;
+      record[13] = sum;
+      for (size_t k = 0; k < 13; ++k)
+      {
+        StoreLE<uint16_t>(&record[offsets[k]], 
+                          chars[(order - 1) * 13 + k]);
+      }
+    }
+
+    pendingRecords_[loc] = record;
+    loc = NextRecordLoc(loc);
+  }
+
+  if (deleted)
+  {
+    entry.lfnLoc = entry.entryLoc;
+    entry.longName.clear();
+  }
+}
+
+// Saves FileEntry
+void Filesys::SaveFileEntry(FileEntry& entry)
+{
+  uint32_t loc = entry.entryLoc; 
+  std::array<uint8_t, 32> record;
+
+  // The record is only queued here, Flush writes it to the image
+  ReadRecord(record.data(), loc);
+  entry.SetCurrentTime();
+
+  for (size_t i = 0; i < 11; ++i)
+    record[i] = i < entry.name.length() ? entry.name[i] : 0;
+
+  record[11] = entry.attr;
+  memset(&record[13], 0, 7);
+  StoreLE<uint16_t>(&record[20], entry.hi);
+  StoreLE<uint16_t>(&record[22], entry.wrtTime);
+  StoreLE<uint16_t>(&record[24], entry.wrtDate);
+  StoreLE<uint16_t>(&record[26], entry.lo);
+  StoreLE<uint32_t>(&record[28], entry.size);
+  pendingRecords_[loc] = record;
+
+  if (entry.lfnLoc != entry.entryLoc)
+    SaveLongName(entry);
+
+  UpdateDirCache(entry);
+  FlushIfFull();
+}
+
+// Validates file name according to 8.3 specifications, putting the
+// padded short name in fixed. Returns false if it does not fit
+bool Filesys::ValidateFileName(std::string name, std::string& fixed)
+{
+  size_t invalidChars = name.find_first_of("/ \"*+`-;:<>=?", 0);
+
+  if (invalidChars != std::string::npos)
+    return false;
+
+  size_t dotPos = name.find_first_of(".", 0);
+  char fixedName[12];
+  fixedName[11] = '\0';
+
+  if (dotPos == 0 || dotPos == name.length() - 1)
+    return false;
+
+  if (dotPos != std::string::npos)
+  {
+    if (name.length() - (dotPos + 1) > 3)
+      return false;
+
+    std::string postfix = name.substr(dotPos + 1, name.length());
+    name = name.substr(0, dotPos);
+
+    // Longer stems used to be cut short, they are long names now
+    if (name.length() > 8)
+      return false;
+
+    for (size_t i = 0; i < 8; ++i)
+    {
+      if (i >= name.length()) 
+        fixedName[i] = ' ';
+      else
+        fixedName[i] = name[i];
+    }
+    for (size_t i = 8; i < 11; ++i)
+    {
+      if (i - 8 >= postfix.length())
+        fixedName[i] = ' ';
+      else
+        fixedName[i] = postfix[i - 8];
+    }
+  }
+  else
+  {
+    if (name.length() > 8)
+      return false;
+
+    for (size_t i = 0; i < 11; ++i)
+    {
+      if (i >= name.length())
+        fixedName[i] = ' ';
+      else
+        fixedName[i] = name[i];
+    }
+  }
+
+  fixed = fixedName;
+  return true;
+}
+
+// Makes a padded 8.3 alias for a long name that no entry of location
+// uses yet, as the start of the name followed by ~n and the start of
+// its extension. Returns an empty string if every alias is taken
+std::string Filesys::MakeAlias(uint32_t location, const std::string& name)
+{
+  size_t dot = name.find_last_of('.');
+  std::string stem, ext;
+
+  auto conv = [] (char c) -> char
+  {
+    if (isalnum((unsigned char)c) && (unsigned char)c < 0x80)
+      return toupper(c);
+    return strchr("!#$%&'()@^_{}~", c) != NULL && c != 0 ? c : '_';
+  };
+
+  // Characters that are neither spaces, dots nor the tail of a UTF-8
+  // sequence make it into the alias
+  auto keep = [&name] (size_t i)
+  {
+    return name[i] != ' ' && name[i] != '.' && (name[i] & 0xC0) != 0x80;
+  };
+
+  for (size_t i = 0; i < name.length() && (dot == 0 || i < dot); ++i)
+  {
+    if (keep(i))
+      stem.push_back(conv(name[i]));
+  }
+
+  if (dot != std::string::npos && dot != 0)
+  {
+    for (size_t i = dot + 1; i < name.length() && ext.length() < 3; ++i)
+    {
+      if (keep(i))
+        ext.push_back(conv(name[i]));
+    }
+  }
+
+  DirCache& dir = GetDirCache(location);
+
+  for (uint32_t n = 1; n < 1000000; ++n)
+  {
+    std::string tail = "~" + std::to_string(n);
+    std::string alias = stem.substr(0, 8 - tail.length()) + tail;
+
+    alias.resize(8, ' ');
+    alias += ext;
+    alias.resize(11, ' ');
+
+    if (dir.byName.find(FormatShortName(alias.data(), 11)) == 
+        dir.byName.end())
+      return alias;
+  }
+  return "";
+}
+
+// Returns the name a new entry typed as name is made with. Names that
+// fit 8.3 are taken in lower case as they always were, long names keep
+// the case they were given in
+std::string Filesys::EntryName(const std::string& name)
+{
+  std::string fixed;
+  return ValidateFileName(FoldName(name), fixed) ? FoldName(name) : name;
+}
+
+// Works out the names of a new entry called name in location, the padded
+// short name and, if name does not fit 8.3, the long name it is an alias
+// of. Returns false after printing an error if name can not be used
+bool Filesys::MakeEntryName(uint32_t location, const std::string& name,
+                            std::string& fixed, std::string& longName)
+{
+  longName.clear();
+
+  if (ValidateFileName(name, fixed))
+    return true;
+
+  if (IsLongName(name))
+  {
+    fixed = MakeAlias(location, name);
+    longName = name;
+    if (!fixed.empty())
+      return true;
+  }
+
+  Fail() << "Invalid Filename" << '\n';
+  return false;
+}
+
+// Allocates a cluster and returns the new cluster number
+// location is optional, if tihs cluster value is passed in
+// then the new cluster is appened to chain at location
+uint32_t Filesys::AllocateCluster(uint32_t location)
+{
+  return AllocateClusters(1, location);
+}
+
+// Allocates count clusters as one chain, preferring a single contiguous
+// run, and returns the first cluster of it. If location is set the chain
+// is appended to the chain at location. Nothing is allocated unless all
+// count clusters can be. The bytes of the new chain in [coverBegin, 
+// coverEnd) are about to be overwritten by the caller and are not zeroed
+uint32_t Filesys::AllocateClusters(uint32_t count, uint32_t location,
+                                   uint64_t coverBegin, uint64_t coverEnd,
+                                   FileEntry* grow)
+{
+  STAT_TIME(stats_, ALLOCATE);
+  std::vector<Extent> runs;
+
+  // Starts at cluster 2 if there is no hint
+  STAT_ADD(stats_, FAT_SCANS, 1);
+  if (count == 0 || !fat_.Reserve(count, fat_.nextFree, runs))
+  {
+    Fail() << "Filesystem out of space" << '\n';
+    return 0;
+  } 
+
+  STAT_ADD(stats_, CLUS_ALLOCATED, count);
+
+  for (size_t i = 0; i < runs.size(); ++i)
+  {
+    uint32_t next = i + 1 < runs.size() ? runs[i + 1].start : 0xFFFFFFFF;
+    LinkRun(runs[i].start, runs[i].length, next);
+  }
+
+  // This appends the new chain to the end of a chain if location is set.
+  // An open file being grown already knows its tail, and its index is
+  // extended with the new runs rather than rebuilt
+  bool indexed = grow != NULL && grow->extentsValid && location != 0;
+
+  if (indexed)
+  {
+    SetNextClus(grow->tail, runs.front().start);
+
+    grow->extentsValid = true;
+    for (Extent& run : runs)
+      grow->AppendRun(run.start, run.length);
+  }
+  else if (location != 0)
+  {
+    uint32_t templocat = location;
+    while (1) 
+    {
+      if ((templocat = GetNextClus(templocat)) >= FATEND)
+        break;
+
+      location = templocat;
+    }
+    SetNextClus(location, runs.front().start);
+  }
+
+  fat_.nextFree = runs.back().start + runs.back().length;
+  UpdateClusCount([count] (uint32_t value) { return value - count;});
+
+  // Directory clusters cover nothing and are zeroed in full, data 
+  // clusters only have the slack around the pending write zeroed
+  uint64_t offset = 0;
+
+  for (Extent& run : runs)
+  {
+    uint64_t runEnd = offset + ((uint64_t)run.length << 
+                                finfo_.ClusBytesShift);
+    size_t pos = finfo_.GetClusPos(run.start);
+
+    DropRecords(pos, runEnd - offset);
+
+    if (coverBegin >= coverEnd || coverEnd <= offset || coverBegin >= runEnd)
+    {
+      FillBytes(0, runEnd - offset, pos);
+    }
+    else
+    {
+      if (coverBegin > offset)
+        FillBytes(0, coverBegin - offset, pos);
+      if (coverEnd < runEnd)
+        FillBytes(0, runEnd - coverEnd, pos + (coverEnd - offset));
+    }
+    offset = runEnd;
+  }
+
+  return runs.front().start;
+}
+
+// Allocates space for a FileEntry, does not actually save it
+Filesys::FileEntry* Filesys::AddEntry(uint32_t location, std::string name,
+                                      uint8_t attr, std::string longName)
+{
+  if (FindEntry(location, longName.empty() ? name : longName) != NULL)
+  {
+    Fail() << "File Already Exists" << '\n';
+    return NULL;
+  }
+
+  // A long name takes one record per 13 characters ahead of the entry,
+  // all of them in a row
+  std::vector<uint16_t> chars;
+  DecodeUtf8(longName, chars);
+  size_t records = 1 + (chars.size() + 12) / 13;
+  size_t first = 0;
+  DirList list = GetFileList(location, true);
+
+  while (1)
+  {
+    size_t run = 0;
+
+    for (first = 0; first < list.size(); ++first)
+    {
+      DirEntry* e = &*(list.begin() + first);
+      if (run != 0 && NextRecordLoc((e - 1)->entryLoc) != e->entryLoc)
+        run = 0;
+      if (++run == records)
+        break;
+    }
+
+    if (first < list.size())
+    {
+      first -= records - 1;
+      break;
+    }
+
+    if (AllocateCluster(location) == 0)
+      return NULL;
+    // The directory chain grew, its index no longer covers it
+    InvalidateDir(location);
+    list = GetFileList(location, true);
+  }
+
+  FileEntry entry(*(list.begin() + first + records - 1));
+  entry.lfnLoc = (list.begin() + first)->entryLoc;
+  entry.longName = longName;
+
+  char value[12];
+  value[11] = '\0';
+  std::transform(name.begin(), name.end(), name.begin(), 
+                ::toupper);
+
+  for (size_t i = 0; i < 11; ++i)
+  {
+    if (i >= name.length())
+      value[i] = ' ';
+    else
+      value[i] = name[i];
+  }
+
+  entry.name = value;
+  entry.attr = attr;
+  entry.SetClus(0);
+  entry.size = 0;
+
+  return new FileEntry(entry);
+}
+
+void Filesys::Fsinfo(std::vector<std::string>& argv)
+{
+  if (argv.size() != 0)
+  {
+    Fail() << "usage: fsinfo" << '\n';
+    return;
+  }
+  else
+  {
+    uint32_t sec = fat_.freeCount * finfo_.SecPerClus;
+    Out() << "  Bytes Per Sector:       " << finfo_.BytesPerSec <<
+    '\n' << "  Sectors Per Cluster:    " << finfo_.SecPerClus <<
+    '\n' << "  Total Sectors:          " << finfo_.TotSec <<
+    '\n' << "  Number of FATs:         " << finfo_.NumFats <<
+    '\n' << "  Sectors Per Fat:        " << finfo_.FATSz32 <<
+    '\n' << "  Number of Free Sectors: " << sec <<
+    '\n';
+  }
+}
+
+void Filesys::Ls(std::vector<std::string>& argv)
+{
+  std::string target;
+  uint32_t currDirClus = Current().cwd;
+
+  if (argv.size() < 1)
+  {
+    target = ".";
+  }
+  else if (argv.size() == 1)
+  {
+    target = argv[0];
+  }
+  else
+  {
+    Fail() << "usage: ls [directory_name]" << '\n';
+    return;
+  }
+
+  std::list<std::string> list = ParseAddress(target);
+
+  try
+  {
+    currDirClus = NavToDir(list, 0, list.size());
+  }
+  catch(std::exception &e)
+  {
+    Fail() << "Error: Invalid Directory" << '\n';
+    return;
+  }
+
+  if (currDirClus == 0)
+    return;
+
+  DirList display = GetFileList(currDirClus);
+
+  for (DirEntry& i : display)
+  {
+    Out() << display.GetName(i) << " ";
+  }
+
+  if (display.size() > 0)
+    Out() << '\n';
+}
+
+void Filesys::Cd(std::vector<std::string>& argv)
+{
+  std::string target;
+  uint32_t currDirClus = Current().cwd;
+
+  if (argv.size() < 1)
+  {
+    target = "/";
+  }
+  else if (argv.size() == 1)
+  {
+    target = argv[0];
+  }
+  else
+  {
+    Fail() << "usage: cd [directory_name]" << '\n';
+    return;
+  }
+
+  std::list<std::string> list = ParseAddress(target);
+
+  try
+  {
+    currDirClus = NavToDir(list, 0, list.size());
+  }
+  catch(std::exception &e)
+  {
+    Fail() << "Error: Invalid Directory" << '\n';
+    return;
+  }
+
+  Current().cwd = currDirClus;
+  Current().location = GenPathName(currDirClus);
+}
+
+void Filesys::Size(std::vector<std::string>& argv)
+{
+  if (argv.size() != 1)
+  {
+    Fail() << "usage: size <entry_name>" << '\n';
+    return;
+  }
+  else
+  {
+    std::list<std::string> address = ParseAddress(argv[0]);
+    uint32_t location = Current().cwd;
+
+    try
+    {
+      location = NavToDir(address, 0, address.size() - 1);
+    }
+    catch (std::exception &e)
+    {
+      Fail() << "Invalid directory" << '\n';
+    }
+
+    std::string name = address.back();
+    DirEntry* e = FindEntry(location, name);
+
+    if (e != NULL)
+    {
+      uint32_t currentCluster = e->clus;
+      size_t count = 0;
+
+      do
+      {
+        currentCluster = GetNextClus(currentCluster);
+        ++count;
+      } while (currentCluster < FATEND);
+
+      Out() << count * finfo_.BytesPerSec * finfo_.SecPerClus
+      << '\n';
+    }
+    else
+      Fail() << "Invalid Filename" << '\n';
+  }
+}
+
+void Filesys::Open(std::vector<std::string>& argv)
+{
+  if (argv.size() != 2)
+  {
+    Fail() << "usage: open <file_name> <mode>" << '\n';
+    return;
+  }
+  else
+  {
+    std::string name = argv[0];
+    uint32_t location = Current().cwd;
+    uint32_t openPermission = 0;
+
+    if (argv[1] == "rw")
+    {
+      openPermission = READ | WRITE;
+    }
+    else if (argv[1] == "r")
+    {
+      openPermission = READ;
+    }
+    else if (argv[1] == "w")
+    {
+      openPermission = WRITE;
+    }
+    else
+    {
+      Fail() << "Invalid Permission" << '\n';
+      return;
+    }
+
+    const std::string* names;
+    DirEntry* e = FindEntry(location, name, &names);
+
+    if (e != NULL && Current().openByLoc.count(e->entryLoc) != 0)
+    {
+      Fail() << "File Already Open" << '\n';
+      return;
+    }
+
+    if (e == NULL)
+    {
+      Fail() << "Invalid Filename" << '\n';
+      return;
+    }
+
+    if ((e->attr & DIRECT) ==  DIRECT)
+    {
+      Fail() << "Error: Cannot Open Directory" << '\n';
+      return;
+    }
+
+    OpenHandle(*e, e->GetLongName(*names), openPermission);
+  }
+}
+
+void Filesys::Close(std::vector<std::string>& argv)
+{
+  if (argv.size() != 1)
+  {
+    Fail() << "Usage: Close <file_name>" << '\n';
+    return;
+  }
+  else
+  {
+    uint32_t handle = FindHandle(Current().cwd, argv[0]);
+
+    if (handle != 0)
+    {
+      CloseHandle(handle);
+      Flush();
+      return;
+    }
+    Fail() << "File not open" << '\n';
+  }
+}
+
+void Filesys::Read(std::vector<std::string>& argv)
+{
+  if (argv.size() != 3)
+  {
+    Fail() << "Usage: Read <file_name> <start> <num_bytes>"
+           << '\n';
+    return;
+  }
+  else
+  {
+    Handle* handle = GetHandle(FindHandle(Current().cwd, argv[0]));
+
+    if (handle == NULL)
+    {
+      Fail() << "Error: File not open" << '\n';
+      return;
+    }
+
+    if ((handle->openInfo & READ) != READ)
+    {
+      Fail() << "Error: File not open for reading" << '\n';
+      return;
+    }
+
+    // May need to validate to ensure arguments are numbers
+
+    uint32_t start = std::stoi(argv[1]);
+    uint32_t length = std::stoi(argv[2]);
+    std::vector<Span> spans;
+
+    {
+      // Other sessions may be reading the same file
+      std::lock_guard<std::mutex> guard(handle->open->lock);
+
+      if (!MapFileRange(handle->open->file, start, length, spans))
+      {
+        Fail() << "Error: Start Parameter out of bounds"
+               << '\n';
+        return;
+      }
+
+      ReadAhead(*handle, start, length);
+    }
+
+    // Output straight from the image when it is mapped
+    for (Span& span : spans)
+    {
+      std::ostream& out = Out();
+      VisitSpan(span, [&out] (const uint8_t* data, size_t len) 
+                { out.write((const char*)data, len); return true; });
+    }
+  }
+}
+
+void Filesys::Write(std::vector<std::string>& argv)
+{
+  if (argv.size() != 3)
+  {
+    Fail() << "Usage: Write <file_name> <start> <quoted_data>"
+           << '\n';
+    return;
+  }
+  else
+  {
+    Handle* handle = GetHandle(FindHandle(Current().cwd, argv[0]));
+
+    if (handle == NULL)
+    {
+      Fail() << "Error: File not open" << '\n';
+      return;
+    }
+
+    if ((handle->openInfo & WRITE) != WRITE)
+    {
+      Fail() << "Error: File not open for writing" << '\n';
+      return;
+    }
+
+    // The one copy of the file every session has open
+    FileEntry* file = &handle->open->file;
+
+    // May need to validate to ensure arguments are numbers
+
+    uint32_t start = std::stoi(argv[1]);
+    std::string input = argv[2];
+    uint32_t length = input.length();
+
+    uint32_t totalSize = start + length;
+    uint32_t clusSize = finfo_.ClusBytes;
+
+    // The extent index of the open file holds its tail and cluster count,
+    // so the chain is only walked the first time
+    if (!file->extentsValid)
+      BuildExtents(*file);
+
+    uint32_t location = file->tail;
+    uint32_t currAllocated = file->clusCount * clusSize;
+
+    uint32_t neededClus = 0;
+    if (totalSize > currAllocated)
+      neededClus = (totalSize - currAllocated + clusSize - 1) >> 
+                   finfo_.ClusBytesShift;
+
+    // A file always gets a first cluster, even for an empty write
+    if (location == 0 && neededClus == 0)
+      neededClus = 1;
+
+    if (neededClus > 0)
+    {
+      // The write itself fills [start, totalSize), so of the new
+      // clusters only the bytes outside that need zeroing
+      uint64_t coverBegin = start > currAllocated ? start - currAllocated : 0;
+      uint32_t first = AllocateClusters(neededClus, location, coverBegin,
+                                        totalSize - currAllocated, file);
+
+      if (first == 0)
+        return;
+
+      if (location == 0)
+      {
+        file->SetClus(first);
+        file->size = totalSize;
+        SaveFileEntry(*file);
+      }
+    }
+
+    if (file->size < totalSize)
+    {
+      file->size = totalSize;
+      SaveFileEntry(*file);
+    }
+
+    if (FileOperate(&input[0], start, length, *file, WRITE) == 0)
+    {
+      Fail() << "An error occured" << '\n';
+    }
+  }
+}
+
+// Creates directory name in location, returns its cluster or 0 if it
+// could not be made
+uint32_t Filesys::MakeDir(uint32_t location, std::string name)
+{
+  std::string fixedName; 
+  std::string longName;
+
+  if (!MakeEntryName(location, name, fixedName, longName))
+    return 0;
+
+  // Other Validations needed
+  FileEntry* entry = AddEntry(location, longName.empty() ? name : fixedName,
+                              DIRECT, longName);
+  uint32_t newCluster = 0;
+
+  if (entry != NULL)
+  {
+    newCluster = AllocateCluster();
+    if (newCluster != 0)
+    {
+      entry->SetClus(newCluster);
+      entry->name = fixedName;
+      FileEntry* level = AddEntry(entry->clus,".          ", DIRECT);
+
+      if (level != NULL)
+      {
+        level->SetClus(newCluster);
+        SaveFileEntry(*level);
+        delete level;
+      }
+
+      // Added once . is saved, so it takes the record after it
+      FileEntry* topLevel = AddEntry(entry->clus,"..         ", DIRECT);
+
+      if (topLevel != NULL)
+      {
+        topLevel->SetClus(location == finfo_.RootClus ? 0 : location);
+        SaveFileEntry(*topLevel);
+        delete topLevel;
+      }
+      SaveFileEntry(*entry);
+      InvalidatePaths();
+    }
+    delete entry;
+  }
+  return newCluster;
+}
+
+// Creates an empty file name in location and returns its saved entry,
+// which must be deallocated after use. Returns NULL on failure
+Filesys::FileEntry* Filesys::MakeFile(uint32_t location, std::string name)
 {
-  WriteValue(&value, 1, finfo_.FsInfo * finfo_.BytesPerSec + 488, 4);
+  std::string fixedName; 
+  std::string longName;
+
+  if (!MakeEntryName(location, name, fixedName, longName))
+    return NULL;
+
+  FileEntry* entry = AddEntry(location, longName.empty() ? name : fixedName,
+                              0, longName);
+
+  if (entry != NULL)
+  {
+    entry->SetClus(0);
+    entry->name = fixedName;
+    SaveFileEntry(*entry);
+  }
+  return entry;
 }
 
-// Calculation found on page 14 of specification
-uint32_t Filesys::Fat32Info::GetFirstSectorOfClus(uint32_t n)
+void Filesys::Mkdir(std::vector<std::string>& argv)
+{
+  if (argv.size() != 1)
+  {
+    Fail() << "Usage: mkdir <dir_name>" << '\n';
+    return;
+  }
+  else
+  {
+    std::list<std::string> address = ParseAddress(argv[0]);
+    uint32_t location = Current().cwd;
+
+    try
+    {
+      location = NavToDir(address, 0, address.size() - 1);
+    }
+    catch (std::exception &e)
+    {
+      Fail() << "Invalid location" << '\n';
+      return;
+    }
+
+    MakeDir(location, EntryName(ParseAddress(argv[0], true).back()));
+  }
+}
+
+void Filesys::Create(std::vector<std::string>& argv)
 {
-  return ((n - 2) * SecPerClus) + FirstDataSec; 
+  if (argv.size() != 1)
+  {
+    Fail() << "Usage: create <file_name>" << '\n';
+    return;
+  }
+  else
+  {
+    std::list<std::string> address = ParseAddress(argv[0]);
+    uint32_t location = Current().cwd;
+
+    try
+    {
+      location = NavToDir(address, 0, address.size() - 1);
+    }
+    catch (std::exception &e)
+    {
+      Fail() << "Invalid location" << '\n';
+    }
+
+    delete MakeFile(location, EntryName(ParseAddress(argv[0], true).back()));
+  }
 }
 
-// Calculation found on page 15 of specification
-uint32_t Filesys::Fat32Info::GetThisFatSecN(uint32_t n)
+Filesys::OpenFile::OpenFile(const DirEntry& entry, 
+                            const std::string& longName) : 
+                            file(entry, longName), lock(), users(0)
 {
-  return RsvdSecCnt + ((n * 4) / BytesPerSec);
 }
 
-// Calculation found on page 15 of specification
-uint32_t Filesys::Fat32Info::GetThisFatEntOff(uint32_t n)
+// Opens the file of entry, with its long name if any, in mode, READ and
+// WRITE, in the current session and returns the handle it is known by
+// there until closed. A file already open in another session is shared
+// with it
+uint32_t Filesys::OpenHandle(DirEntry& entry, const std::string& longName,
+                             uint32_t mode)
+{
+  Session& session = Current();
+  OpenFile* open;
+
+  {
+    std::lock_guard<std::mutex> guard(openLock_);
+    std::unordered_map<uint32_t, std::list<OpenFile>::iterator>::iterator 
+          found = openIndex_.find(entry.entryLoc);
+
+    if (found == openIndex_.end())
+    {
+      openFiles_.emplace_back(entry, longName);
+      found = openIndex_.insert(std::make_pair(entry.entryLoc, 
+                                  --openFiles_.end())).first;
+    }
+    open = &*found->second;
+    ++open->users;
+  }
+
+  uint32_t handle = session.nextHandle++;
+  Handle opened = { open, mode, 0, 0 };
+
+  session.openFiles[handle] = opened;
+  session.openByLoc[entry.entryLoc] = handle;
+  return handle;
+}
+
+// Returns the handle of the current session, NULL if it is not open
+Filesys::Handle* Filesys::GetHandle(uint32_t handle)
+{
+  Session& session = Current();
+  std::unordered_map<uint32_t, Handle>::iterator found = 
+        session.openFiles.find(handle);
+
+  return found == session.openFiles.end() ? NULL : &(found->second);
+}
+
+// Drops a handle on open, which is forgotten once no session has it open
+void Filesys::ReleaseFile(OpenFile& open)
+{
+  if (--open.users != 0)
+    return;
+
+  std::unordered_map<uint32_t, std::list<OpenFile>::iterator>::iterator 
+        found = openIndex_.find(open.file.entryLoc);
+
+  openFiles_.erase(found->second);
+  openIndex_.erase(found);
+}
+
+// Returns the handle of the open file called name in the directory at
+// cluster, 0 if it is not open there
+uint32_t Filesys::FindHandle(uint32_t cluster, const std::string& name)
+{
+  DirEntry* e = FindEntry(cluster, name);
+
+  if (e == NULL)
+    return 0;
+
+  Session& session = Current();
+  std::unordered_map<uint32_t, uint32_t>::iterator found = 
+        session.openByLoc.find(e->entryLoc);
+  return found == session.openByLoc.end() ? 0 : found->second;
+}
+
+void Filesys::CloseHandle(uint32_t handle)
+{
+  Session& session = Current();
+  std::unordered_map<uint32_t, Handle>::iterator found = 
+        session.openFiles.find(handle);
+
+  if (found == session.openFiles.end())
+    return;
+
+  session.openByLoc.erase(found->second.open->file.entryLoc);
+  ReleaseFile(*found->second.open);
+  session.openFiles.erase(found);
+}
+
+// Closes the file with its record at entryLoc in every session
+void Filesys::CloseEverywhere(uint32_t entryLoc)
+{
+  for (Session& session : sessions_)
+  {
+    std::unordered_map<uint32_t, uint32_t>::iterator found = 
+          session.openByLoc.find(entryLoc);
+
+    if (found == session.openByLoc.end())
+      continue;
+
+    std::unordered_map<uint32_t, Handle>::iterator handle = 
+          session.openFiles.find(found->second);
+
+    ReleaseFile(*handle->second.open);
+    session.openFiles.erase(handle);
+    session.openByLoc.erase(found);
+  }
+}
+
+// Returns the async I/O engine, setting it up on first use
+IoEngine& Filesys::GetIo()
+{
+  if (io_ == NULL)
+    io_ = new IoEngine();
+  return *io_;
+}
+
+// Moves the bytes of spans, in order, between the image and the host file
+// fd, into the image if import is set. Up to the depth of the I/O engine
+// pieces are in flight at once. Mapped images are read into or written
+// from in place, otherwise each piece goes through an aligned buffer and
+// the image descriptor. Returns false if any piece came up short
+bool Filesys::TransferSpans(std::vector<Span>& spans, int fd, bool import)
+{
+  IoEngine& io = GetIo();
+  size_t align = storage_->Alignment();
+  std::vector<uint8_t*> buffers;
+  std::vector<uint8_t*> idle;
+  bool success = true;
+  uint64_t hostPos = 0;
+
+  for (Span& span : spans)
+  {
+    if (import)
+      STAT_ADD(stats_, BYTES_WRITTEN, span.len);
+    else
+      STAT_ADD(stats_, BYTES_READ, span.len);
+  }
+
+  // Hands out a free buffer, waiting for one if all of them are in use
+  auto take = [&] ()
+  {
+    while (idle.empty() && buffers.size() >= io.Depth())
+      io.WaitOne();
+
+    if (idle.empty())
+    {
+      void* data = NULL;
+      if (posix_memalign(&data, std::max<size_t>(align, 4096), 
+                         COPY_CHUNK + 2 * align) != 0)
+        throw std::exception();
+      buffers.push_back((uint8_t*)data);
+      return (uint8_t*)data;
+    }
+
+    uint8_t* data = idle.back();
+    idle.pop_back();
+    return data;
+  };
+
+  try
+  {
+    for (Span& span : spans)
+    {
+      for (size_t done = 0; done < span.len; done += COPY_CHUNK)
+      {
+        size_t piece = std::min<size_t>(COPY_CHUNK, span.len - done);
+        size_t pos = span.pos + done;
+        uint64_t off = hostPos + done;
+
+        if (mFilesys_ != NULL && import)
+        {
+          io.Read(fd, mFilesys_ + pos, piece, off, 
+                  [this, &success, piece, pos] (ssize_t moved)
+          {
+            // The host file shrank while reading, leave zeroes behind
+            size_t got = moved > 0 ? moved : 0;
+            if (got < piece)
+            {
+              FillBytes(0, piece - got, pos + got);
+              success = false;
+            }
+          });
+        }
+        else if (mFilesys_ != NULL)
+        {
+          io.Write(fd, mFilesys_ + pos, piece, off, 
+                   [&success, piece] (ssize_t moved)
+          {
+            if (moved != (ssize_t)piece)
+              success = false;
+          });
+        }
+        else if (import)
+        {
+          uint8_t* buf = take();
+
+          io.Read(fd, buf, piece, off, 
+                  [&, buf, piece, pos] (ssize_t moved)
+          {
+            size_t got = moved > 0 ? moved : 0;
+            if (got < piece)
+            {
+              memset(buf + got, 0, piece - got);
+              success = false;
+            }
+
+            // Pieces the device cannot take as they are go through the
+            // block cache instead
+            if (pos % align != 0 || piece % align != 0)
+            {
+              WriteBytes(buf, piece, pos);
+              idle.push_back(buf);
+              return;
+            }
+
+            storage_->Bypass(pos, piece);
+            io.Write(storage_->Fd(), buf, piece, pos, 
+                     [&, buf, piece] (ssize_t written)
+            {
+              if (written != (ssize_t)piece)
+                success = false;
+              idle.push_back(buf);
+            });
+          });
+        }
+        else
+        {
+          uint8_t* buf = take();
+          size_t begin = pos - pos % align;
+          size_t end = std::min(storage_->Size(), 
+                                (pos + piece + align - 1) / align * align);
+          size_t skip = pos - begin;
+
+          storage_->Bypass(begin, end - begin);
+          io.Read(storage_->Fd(), buf, end - begin, begin, 
+                  [&, buf, piece, off, skip] (ssize_t moved)
+          {
+            if (moved < (ssize_t)(skip + piece))
+            {
+              success = false;
+              idle.push_back(buf);
+              return;
+            }
+
+            io.Write(fd, buf + skip, piece, off, 
+                     [&, buf, piece] (ssize_t written)
+            {
+              if (written != (ssize_t)piece)
+                success = false;
+              idle.push_back(buf);
+            });
+          });
+        }
+      }
+      hostPos += span.len;
+    }
+    io.Wait();
+  }
+  catch (std::exception &e)
+  {
+    io.Wait();
+    success = false;
+  }
+
+  for (uint8_t* data : buffers)
+    free(data);
+
+  return success;
+}
+
+// Copies host file into a new file name in location. The clusters are
+// allocated in one batch and filled from the host file by the I/O engine
+bool Filesys::ImportFile(std::string host, uint32_t location, 
+                         std::string name)
+{
+  struct stat fstatus;
+  int fd = open(host.c_str(), O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &fstatus) < 0)
+  {
+    Fail() << "Error: Unable to read " << host << '\n';
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+
+  if ((uint64_t)fstatus.st_size > 0xFFFFFFFF)
+  {
+    Fail() << "Error: " << host << " is too large" << '\n';
+    close(fd);
+    return false;
+  }
+
+  FileEntry* entry = MakeFile(location, name);
+
+  if (entry == NULL)
+  {
+    close(fd);
+    return false;
+  }
+
+  uint32_t size = fstatus.st_size;
+  uint32_t clusSize = finfo_.ClusBytes;
+  bool success = true;
+
+  if (size > 0)
+  {
+    // Every byte of the new chain up to size is read into, so only the
+    // slack of the last cluster is zeroed
+    uint32_t first = AllocateClusters((size - 1) / clusSize + 1, 0, 0, 
+                                      size);
+
+    if (first != 0)
+    {
+      std::vector<Span> spans;
+
+      entry->SetClus(first);
+      entry->size = size;
+      MapFileRange(*entry, 0, size, spans);
+
+      success = TransferSpans(spans, fd, true);
+      SaveFileEntry(*entry);
+    }
+    else
+      success = false;
+  }
+
+  if (!success)
+    Fail() << "Error: Unable to import " << host << '\n';
+
+  delete entry;
+  close(fd);
+  return success;
+}
+
+// Copies every file and directory under the host directory into the
+// directory at location
+void Filesys::ImportTree(std::string host, uint32_t location)
+{
+  DIR* dir = opendir(host.c_str());
+
+  if (dir == NULL)
+  {
+    Fail() << "Error: Unable to read " << host << '\n';
+    return;
+  }
+
+  struct dirent* item;
+  while ((item = readdir(dir)) != NULL)
+  {
+    std::string name = item->d_name;
+    std::string path = host + "/" + name;
+    struct stat fstatus;
+
+    if (name == "." || name == ".." || stat(path.c_str(), &fstatus) < 0)
+      continue;
+
+    name = EntryName(name);
+
+    if (S_ISDIR(fstatus.st_mode))
+    {
+      DirEntry* existing = FindEntry(location, name);
+      uint32_t cluster = existing != NULL && existing->IsDir() ? 
+                         existing->clus : MakeDir(location, name);
+      if (cluster != 0)
+        ImportTree(path, cluster);
+    }
+    else if (S_ISREG(fstatus.st_mode))
+    {
+      ImportFile(path, location, name);
+    }
+  }
+  closedir(dir);
+}
+
+// Copies a file out to host through the I/O engine
+bool Filesys::ExportFile(DirEntry& entry, std::string host)
+{
+  int fd = open(host.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if (fd < 0)
+  {
+    Fail() << "Error: Unable to write " << host << '\n';
+    return false;
+  }
+
+  bool success = true;
+
+  if (entry.clus != 0 && entry.size > 0)
+  {
+    FileEntry file(entry);
+    std::vector<Span> spans;
+
+    success = MapFileRange(file, 0, entry.size, spans) && 
+              TransferSpans(spans, fd, false);
+  }
+
+  if (!success)
+    Fail() << "Error: Unable to export to " << host << '\n';
+
+  close(fd);
+  return success;
+}
+
+// Copies every file and directory in the directory at cluster out to the
+// host directory, creating it if needed
+void Filesys::ExportTree(uint32_t cluster, std::string host)
 {
-  return (n * 4) % BytesPerSec;
+  if (mkdir(host.c_str(), 0755) < 0 && errno != EEXIST)
+  {
+    Fail() << "Error: Unable to write " << host << '\n';
+    return;
+  }
+
+  DirList list = GetFileList(cluster);
+
+  for (DirEntry& e : list)
+  {
+    std::string name = e.GetShortName();
+
+    if (name == "." || name == ".." || (e.attr & VOLID) == VOLID)
+      continue;
+
+    name = list.GetName(e);
+    if (e.IsDir())
+      ExportTree(e.clus, host + "/" + name);
+    else
+      ExportFile(e, host + "/" + name);
+  }
 }
 
-// Gets the end of fat
-uint32_t Filesys::Fat32Info::GetEndOfFat()
-{
-  return (TotSec - FirstDataSec) / SecPerClus + 1;
+void Filesys::Import(std::vector<std::string>& argv)
+{
+  bool recursive = argv.size() == 3 && argv[0] == "-r";
+
+  if (argv.size() != 2 && !recursive)
+  {
+    Fail() << "Usage: import [-r] <host_path> <entry_name>" << '\n';
+    return;
+  }
+
+  std::string host = argv[argv.size() - 2];
+  std::list<std::string> address = ParseAddress(argv.back());
+  uint32_t location = Current().cwd;
+
+  try
+  {
+    location = NavToDir(address, 0, address.size() - 1);
+  }
+  catch (std::exception &e)
+  {
+    Fail() << "Invalid location" << '\n';
+    return;
+  }
+
+  if (!recursive)
+  {
+    ImportFile(host, location, 
+               EntryName(ParseAddress(argv.back(), true).back()));
+    return;
+  }
+
+  // Fill the directory if it is there already, otherwise make it
+  uint32_t cluster = 0;
+  try
+  {
+    cluster = NavToDir(address, 0, address.size());
+  }
+  catch (std::exception &e)
+  {
+    cluster = MakeDir(location, 
+                      EntryName(ParseAddress(argv.back(), true).back()));
+  }
+
+  if (cluster != 0)
+    ImportTree(host, cluster);
 }
 
-Filesys::FileEntry::FileEntry(char* n, uint8_t a, uint16_t l, 
-                              uint16_t h, uint32_t s, uint32_t el) :
-                            name(n), attr(a), lo(l), hi(h), wrtTime(), 
-                            wrtDate(), size(s), clus(), entryLoc(el), 
-                            openInfo(0)
+void Filesys::Export(std::vector<std::string>& argv)
 {
-  // Cluster number broken into two seperate integers, this combines
-  // them into one integer
-  clus = lo;
-  clus |= hi << 16;
-}
+  std::lock_guard<std::mutex> guard(ioLock_);
+  bool recursive = argv.size() == 3 && argv[0] == "-r";
 
-Filesys::FileEntry::FileEntry(const FileEntry& a) :
-                            name(a.name), attr(a.attr), lo(a.lo), 
-                            hi(a.hi), size(a.size), clus(a.clus), 
-                            entryLoc(a.entryLoc), openInfo(a.openInfo)
-{
-  // Cluster number broken into two seperate integers, this combines
-  // them into one integer
-  clus = lo;
-  clus |= hi << 16;
-}
+  if (argv.size() != 2 && !recursive)
+  {
+    Fail() << "Usage: export [-r] <entry_name> <host_path>" << '\n';
+    return;
+  }
 
-// Turns short name into lowercase format
-// Ex "FILE   PDF" -> "file.pdf"
-std::string Filesys::FileEntry::GetShortName()
-{
-  std::string newName, postfix;
-  size_t length = name.length();
+  std::list<std::string> address = ParseAddress(argv[argv.size() - 2]);
+  std::string host = argv.back();
 
-  for (size_t i = 0; i < length && i < 8; ++i)
+  if (recursive)
   {
-    if (name[i] != ' ')
-      newName.push_back(name[i]);
+    try
+    {
+      ExportTree(NavToDir(address, 0, address.size()), host);
+    }
+    catch (std::exception &e)
+    {
+      Fail() << "Error: Invalid Directory" << '\n';
+    }
+    return;
   }
 
-  for (size_t i = 8; i < length && i < 11; ++i)
+  DirEntry* entry = NULL;
+  try
+  {
+    entry = FindEntry(NavToDir(address, 0, address.size() - 1), 
+                      address.back());
+  }
+  catch (std::exception &e)
   {
-    if (name[i] != ' ')
-      postfix.push_back(name[i]);
   }
 
-  if (postfix.length() != 0)
-    newName += "." + postfix;
-
-  std::transform(newName.begin(), newName.end(), newName.begin(), 
-                  ::tolower);
-  return newName;
-}
+  if (entry == NULL || entry->IsDir())
+  {
+    Fail() << "Invalid Filename" << '\n';
+    return;
+  }
 
-// Returns true if entry is a directory
-bool Filesys::FileEntry::IsDir()
-{
-  if ((attr & DIRECT) == DIRECT) 
-    return true;
-  else
-    return false;
+  DirEntry file = *entry;
+  ExportFile(file, host);
 }
 
-// Sets the time field
-void Filesys::FileEntry::SetCurrentTime()
+// Claims count free clusters as one chain, taking the free runs found
+// going on from cluster without wrapping around. Returns the first cluster
+// of the chain, or 0 if there are not count free clusters past cluster
+uint32_t Filesys::ClaimFreeChain(uint32_t cluster, uint32_t count)
 {
-  time_t timer;
-  struct tm* localTime;
+  std::vector<Extent> runs;
+  uint32_t total = 0;
 
-  time(&timer);
-  localTime = localtime(&timer);
-  
-  wrtDate = localTime->tm_mday;
-  wrtDate |= ((localTime->tm_mon + 1) << 5);
-  wrtDate |= ((localTime->tm_year - 80) << 9);
+  if (cluster < 2)
+    cluster = 2;
 
-  uint8_t tValue = localTime->tm_sec / 2;
-  wrtTime = tValue > 29 ? 29 : tValue;
-  wrtTime |= (localTime->tm_min << 5);
-  wrtTime |= (localTime->tm_hour << 11);
-}
+  STAT_ADD(stats_, FAT_SCANS, 1);
+  while (total < count && 
+         (cluster = fat_.FindFreeIn(cluster, fat_.endOfFat)) != 0)
+  {
+    uint32_t length = fat_.RunLength(cluster, count - total);
+    Extent run = { total, cluster, length };
+    runs.push_back(run);
+    total += length;
+    cluster += length;
+  }
 
-// Sets the Cluster information for the file entry
-void Filesys::FileEntry::SetClus(uint32_t cluster)
-{
-  clus = cluster;
-  hi = (cluster & 0xFFFF0000) >> 4;
-  lo = cluster & 0x0000FFFF;
-}
+  if (count == 0 || total < count)
+    return 0;
 
-// Breaks up address into list of locations
-// Ex /exdir/test/file -> list {exdir, test, file}
-std::list<std::string> Filesys::ParseAddress(std::string add)
-{
-  std::list<std::string> list;
-  if (add.size() != 0)
+  for (size_t i = 0; i < runs.size(); ++i)
   {
-    size_t start = 0;
-    size_t end;
-    
-    std::transform(add.begin(), add.end(), add.begin(), 
-                  ::tolower);
-
-    if (add[0] == '/')
-    {
-      list.push_back("/");
-      start = 1;
-    }
+    uint32_t next = i + 1 < runs.size() ? runs[i + 1].start : 0xFFFFFFFF;
+    LinkRun(runs[i].start, runs[i].length, next);
+  }
 
-    while((end = add.find_first_of("/", start)) != 
-                                                 std::string::npos)
-    {
-      if (start - end != 0)
-      {
-          list.push_back(add.substr(start, end - start));
-      }
+  UpdateClusCount([count] (uint32_t value) { return value - count; });
+  STAT_ADD(stats_, CLUS_ALLOCATED, count);
+  return runs.front().start;
+}
 
-      start = end + 1;
-    }
+// Collects the deleted entries of the directory at cluster. Only reads,
+// so it can run on several workers at once
+void Filesys::ListDeleted(uint32_t cluster, std::vector<DirEntry>& out)
+{
+  std::vector<DirEntry> entries;
+  // Deleted entries come without long names
+  std::string names;
+  size_t limit = fat_.entries.size();
 
-    if (start < add.size())
-      list.push_back(add.substr(start));
+  while (cluster >= 2 && cluster < FATEND && limit-- > 0)
+  {
+    ReadClusEntries(cluster, true, entries, names);
+    cluster = GetNextClus(cluster);
   }
 
-  return list;
+  for (DirEntry& e : entries)
+  {
+    if ((unsigned char)e.name[0] == DEALLOC && (e.attr & LONG) != LONG)
+      out.push_back(e);
+  }
 }
 
-// Takes list of locations from ParseAddress and returns the cluster
-// of the final location. Start and end specifices the range in the 
-// list to navigate. End is not inclusive, start is inclusive
-uint32_t Filesys::NavToDir(std::list<std::string>& list, size_t start, 
-                           size_t end)
+// Brings back the deleted entries of the directory at location as 
+// RECVD_n, giving each the free clusters found from its old start on.
+// Entries that can not get all their clusters are left deleted. Stops
+// once the directory holds UNDELETE_MAX recovered entries. Returns the
+// number of entries brought back
+uint32_t Filesys::RecoverEntries(uint32_t location, 
+                                 std::vector<DirEntry>& deleted)
 {
-  uint32_t currDirClus = cwd_;
-  bool found;
+  uint32_t clusSize = finfo_.ClusBytes;
+  uint32_t recovered = 0;
+  uint16_t count = 0;
 
-  // Nowhere to navigate
-  if (start - end == 0)
-    return currDirClus;
+  for (auto& named : GetDirCache(location).byName)
+  {
+    if (named.first.substr(0, 6) == "recvd_")
+      ++count;
+  }
 
-  // Nowhere to navigate
-  if (list.size() == 0)
-    throw std::exception();
+  if (count > UNDELETE_MAX)
+    return 0;
 
-  size_t i = start;
-  for (std::string item : list)
+  for (DirEntry& d : deleted)
   {
-    if (i == end)
-      break;
+    FileEntry e(d);
+    uint32_t clusterCount = 1;
 
-    if (i == 0 && item == "/")
+    if (!e.IsDir())
+      clusterCount = e.size / clusSize + (e.size % clusSize != 0);
+
+    if (e.clus != 0)
     {
-      // Start at root
-      currDirClus = finfo_.RootClus;
+      uint32_t first = ClaimFreeChain(e.clus, clusterCount);
+
+      if (first == 0 && clusterCount != 0)
+        continue;
+
+      e.SetClus(first);
     }
-    else if (item != "." || currDirClus != finfo_.RootClus)
-    {
-      // Will not enter here if . and in root dir because there is no
-      // . in that directory
-      std::list<FileEntry>* entries = GetFileList(currDirClus);
-      found = false;
 
-      for (FileEntry e : *entries)
-      {
-        if (e.GetShortName() == item && e.IsDir())
-        {
-          // .. in level below root has clus of 0
-          if (e.clus == 0 && item == "..")
-            currDirClus = finfo_.RootClus;
-          else
-          {
-            currDirClus = e.clus;
-          }
+    ++count;
+    std::ostringstream number;
+    number << "RECVD_" <<  count;
+    size_t padding = 11 - number.str().length();
+    e.name = number.str();
 
-          found = true;
-          break;
-        }
-      }
+    for (size_t i = 0; i < padding; ++i)
+      e.name += ' ';
 
-      delete entries;
+    SaveFileEntry(e);
+    ++recovered;
 
-      if (found == false)
-      {
-        throw std::exception();
-      }
-    }
-    ++i;
+    if (count >= UNDELETE_MAX)
+      break;
   }
-  return currDirClus;
+
+  if (recovered != 0)
+    InvalidatePaths();
+
+  return recovered;
 }
 
-// Gets the path name to a cluster
-std::string Filesys::GenPathName(uint32_t clus)
+void Filesys::Undelete(std::vector<std::string>& argv)
 {
-  std::string name;
-  uint32_t curClus = cwd_;
-  uint32_t prevClus = clus;
-  uint32_t foundClus = clus;
-  std::list<FileEntry>* list;
+  if (argv.empty())
+  {
+    std::vector<DirEntry> deleted;
+    ListDeleted(Current().cwd, deleted);
+    RecoverEntries(Current().cwd, deleted);
+    return;
+  }
 
-  while(curClus != finfo_.RootClus)
+  if (argv[0] != "-r" || argv.size() > 2)
   {
-    curClus = foundClus;
-    list = GetFileList(curClus);
+    Fail() << "usage: undelete [-r [directory_name]]" << '\n';
+    return;
+  }
+
+  uint32_t cluster;
+  std::string path;
+
+  if (!GetTreeRoot(argv, 1, cluster, path))
+    return;
 
-    for (FileEntry e : *list)
+  // Every directory of the tree, in path order so names are handed out
+  // the same way on every run
+  std::vector<std::vector<std::pair<std::string, uint32_t>>> 
+      found(GetPool().Size());
+  std::vector<std::pair<std::string, uint32_t>> dirs;
+
+  dirs.push_back(std::make_pair(path, cluster));
+  if (!WalkTree(cluster, path, 
+        [&found] (size_t worker, const std::string& p, DirEntry& e) 
+        { 
+          if (e.IsDir() && e.clus >= 2) 
+            found[worker].push_back(std::make_pair(p, e.clus)); 
+        }))
+    Fail() << "Error: Part of the tree could not be read" << '\n';
+
+  for (auto& list : found)
+    dirs.insert(dirs.end(), list.begin(), list.end());
+  std::sort(dirs.begin() + 1, dirs.end());
+
+  // Directories are scanned in parallel, recovering claims clusters and
+  // so goes one directory at a time
+  std::vector<std::vector<DirEntry>> deleted(dirs.size());
+  std::atomic<bool> failed(false);
+  WorkPool& pool = GetPool();
+
+  for (size_t i = 0; i < dirs.size(); ++i)
+  {
+    pool.Submit([this, &dirs, &deleted, &failed, i] (size_t)
     {
-      if (e.GetShortName() == "..")
+      try
       {
-        if (e.clus == 0)
-          foundClus = finfo_.RootClus;
-        else
-          foundClus = e.clus;
+        ListDeleted(dirs[i].second, deleted[i]);
       }
-
-      if (prevClus == e.clus && e.GetShortName() != ".")
+      catch (std::exception &e)
       {
-        if (name.length() == 0)
-          name = e.GetShortName();
-        else
-          name = e.GetShortName() + "/" + name;
-        prevClus = curClus;
+        failed = true;
       }
-    }
-    delete list;
+    });
   }
+  pool.Wait();
 
-  return "/" + name;
-}
+  if (failed)
+    Fail() << "Error: Part of the tree could not be read" << '\n';
 
-// Saves FileEntry
-void Filesys::SaveFileEntry(FileEntry& entry)
-{
-  uint32_t loc = entry.entryLoc; 
-  uint32_t zero = 0;
-  char name[11];
+  uint32_t recovered = 0;
+  size_t touched = 0;
 
-  for (int i = 0; i < 11; ++i)
-    name[i] = entry.name[i];
+  for (size_t i = 0; i < dirs.size(); ++i)
+  {
+    if (deleted[i].empty())
+      continue;
 
-  entry.SetCurrentTime();
+    uint32_t n = RecoverEntries(dirs[i].second, deleted[i]);
+    recovered += n;
+    touched += n != 0;
+  }
 
-  WriteValue(name, 11, loc , 1);
-  WriteValue(&(entry.attr), 1, loc + 11, 1);
-  WriteValue(&zero, 1, loc + 13, 1);
-  WriteValue(&zero, 1, loc + 14, 2);
-  WriteValue(&zero, 1, loc + 16, 2);
-  WriteValue(&zero, 1, loc + 18, 2);
-  WriteValue(&(entry.hi), 1, loc + 20, 2);
-  WriteValue(&(entry.wrtTime), 1, loc + 22, 2);
-  WriteValue(&(entry.wrtDate), 1, loc + 24, 2);
-  WriteValue(&(entry.lo), 1, loc + 26, 2);
-  WriteValue(&(entry.size), 1, loc + 28, 4);
+  Out() << "Recovered " << recovered << " entries in " << touched
+        << " directories" << '\n';
 }
 
-// Validates file name according to specifications
-std::string Filesys::ValidateFileName(std::string name)
+void Filesys::Rm(std::vector<std::string>& argv)
 {
-  size_t invalidChars = name.find_first_of("/ \"*+`-;:<>=?", 0);
+  uint32_t location = Current().cwd;
+  std::vector<uint32_t> chains;
 
-  if (invalidChars != std::string::npos)
+  if (argv.size() == 0)
   {
-    std::cout << "Invalid Filename" << std::endl;
-    throw std::exception();
+    Fail() << "Usage: rm <file_name>\n";
+    return;
   }
 
-  size_t dotPos = name.find_first_of(".", 0);
-  char fixedName[12];
-  fixedName[11] = '\0';
-
-  std::string originalName = name;
-
-  if (dotPos == 0 || dotPos == name.length() - 1)
+  // maybe have code to parse the input in case file has leading dir
+  // for loop to allow removing multiple files at once
+  for (uint32_t i=0; i < argv.size(); i++)
   {
-    std::cout << "Invalid Filename" << std::endl;
-    throw std::exception();
-  }
+    std::string name = argv[i];
 
-  if (dotPos != std::string::npos)
-  {
-    if (name.length() - (dotPos + 1) > 3)
+    // to check if file is open, and closing befire removing
+    if (FindHandle(location, name) != 0)
     {
-      std::cout << "Invalid Filename" << std::endl;
-      throw std::exception();
+      std::vector<std::string> list;
+      list.push_back(argv[i]);
+      Close(list);
     }
 
-    std::string postfix = name.substr(dotPos + 1, name.length());
-    name = name.substr(0, dotPos);
+    DirEntry* found = FindEntry(location, name);
 
-    for (size_t i = 0; i < 8; ++i)
+    if (found != NULL && !found->IsDir())
     {
-      if (i >= name.length()) 
-        fixedName[i] = ' ';
-      else
-        fixedName[i] = name[i];
-    }
-    for (size_t i = 8; i < 11; ++i)
-    {
-      if (i - 8 >= postfix.length())
-        fixedName[i] = ' ';
-      else
-        fixedName[i] = postfix[i - 8];
+      FileEntry e(*found);
+
+      // Other sessions lose the file too
+      CloseEverywhere(e.entryLoc);
+
+      // Chains are freed together once every file has been looked at
+      if (e.clus != 0)
+        chains.push_back(e.clus);
+      
+      e.name[0] = 0xe5;
+      SaveFileEntry(e);
+      InvalidatePaths();
     }
-  }
-  else
-  {
-    if (name.length() > 8)
+    else
     {
-      std::cout << "Invalid Filename" << std::endl;
-      throw std::exception();
+      Fail() << "File " << name << " not found!\n";
+      break;
     }
 
-    for (size_t i = 0; i < 11; ++i)
-    {
-      if (i >= name.length())
-        fixedName[i] = ' ';
-      else
-        fixedName[i] = name[i];
-    }
   }
 
-  std::string output(fixedName);
-  return output;
+  FreeChains(chains);
 }
 
-// Allocates a cluster and returns the new cluster number
-// location is optional, if tihs cluster value is passed in
-// then the new cluster is appened to chain at location
-uint32_t Filesys::AllocateCluster(uint32_t location)
+void Filesys::Rmdir(std::vector<std::string>& argv)
 {
-  // Allocate new cluster
-  uint32_t position = GetFATNxtFree();
-  uint32_t entryValue;
-  bool found = false;
-  int startFromTop = 0;
-  uint32_t endOfFat = finfo_.GetEndOfFat();
-
-  if (position == 0xFFFFFFFF)
+  if (argv.size() != 1)
   {
-    // Start at cluster 2 if no hint
-    position = 2;
-    startFromTop = 1;
+    Fail() << "usage: rmdir <dir_name>" << '\n';
+    return;
   }
-
-  do
+  else
   {
-    do
+    std::string name = argv[0];
+    uint32_t location = Current().cwd;
+    DirEntry* found = NULL;
+
+    if (name[0] != '.')
+      found = FindEntry(location, name);
+
+    if (found == NULL || !found->IsDir())
+    {
+      Fail() << "Invalid Filename" << '\n';
+      return;
+    }
+
+    FileEntry* entry = new FileEntry(*found);
+    
+    if (GetDirCache(entry->clus).byName.size() > 2)
     {
-      entryValue = GetNextClus(position);
-      if (entryValue == 0)
-      {
-        found = true;
-        break;
-      }
-      ++position;
-    } while (position < endOfFat);
+      Fail() << "Directory must be empty" << '\n';
+      delete entry;
+      return;
+    }
+
+    entry->name[0] = 0xe5;
+    SaveFileEntry(*entry);
 
-    ++startFromTop;
+    if (entry->clus != 0)
+      FreeChains(std::vector<uint32_t>(1, entry->clus));
 
-    if (!found) 
-      position = 2;
+    InvalidateDir(entry->clus);
+    InvalidatePaths();
+    delete entry;
   }
-  while (!found && startFromTop < 2);
+}
 
-  if (!found)
-  {
-    std::cout << "Filesystem out of space" << std::endl;
-    return 0;
-  } 
+// Resolves the optional directory argument of the tree commands, returns
+// false after printing an error if it is not a directory
+bool Filesys::GetTreeRoot(std::vector<std::string>& argv, size_t index,
+                          uint32_t& cluster, std::string& path)
+{
+  path = argv.size() > index ? argv[index] : ".";
+  std::list<std::string> list = ParseAddress(path);
 
-  // This appends the new cluster to the end of a chain if location is set
-  if (location != 0)
+  try
   {
-    uint32_t templocat = location;
-    while (1) 
-    {
-      if ((templocat = GetNextClus(templocat)) >= FATEND)
-        break;
-
-      location = templocat;
-    }
-    SetNextClus(location, position);
+    cluster = NavToDir(list, 0, list.size());
+  }
+  catch(std::exception &e)
+  {
+    Fail() << "Error: Invalid Directory" << '\n';
+    return false;
   }
 
-  SetNextClus(position, 0xFFFFFFFF);
-  SetFATNxtFree(position);
-  UpdateClusCount([] (uint32_t value) { return value - 1;});
-  ZeroOutCluster(position);
-
-  return position;
-}
+  if (cluster == 0)
+    cluster = finfo_.RootClus;
 
-// Zeroes out the speciied cluster
-void Filesys::ZeroOutCluster(uint32_t cluster)
-{
-  uint32_t start = finfo_.BytesPerSec * 
-                   finfo_.GetFirstSectorOfClus(cluster);
-  uint32_t len = finfo_.BytesPerSec * finfo_.SecPerClus;
-  uint8_t zero = 0;
+  while (path.length() > 1 && path[path.length() - 1] == '/')
+    path.erase(path.length() - 1);
 
-  for (uint32_t i = 0; i < len; ++i)
-    WriteValue(&zero, 1, start + i, 1); 
+  return true;
 }
 
-// Allocates space for a FileEntry, does not actually save it
-Filesys::FileEntry* Filesys::AddEntry(uint32_t location, std::string name,
-                                      uint8_t attr)
+// Checksums file with the CRC-32 used by zlib. Returns false if its chain
+// is broken or too short for its size
+bool Filesys::FileCrc(DirEntry& entry, uint32_t& sum)
 {
-  std::list<FileEntry>* list = GetFileList(location);
+  static uint32_t table[256];
+  static std::once_flag tableOnce;
 
-  for (FileEntry e : *list)
+  std::call_once(tableOnce, [] 
   {
-    if (e.GetShortName() == name)
+    for (uint32_t i = 0; i < 256; ++i)
     {
-      std::cout << "File Already Exists" << std::endl;
-      delete list;
-      return NULL;
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k)
+        c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      table[i] = c;
     }
-  }
+  });
 
-  delete list;
-  list = GetFileList(location, true);
+  uint32_t crc = 0xFFFFFFFF;
 
-  if (list->size() == 0)
+  if (entry.size > 0)
   {
-    delete list;
-    if (AllocateCluster(location) == 0)
-      return NULL;
-    list = GetFileList(location, true);
-  }
+    FileEntry file(entry);
+    std::vector<Span> spans;
+    uint64_t mapped = 0;
 
-  FileEntry entry = list->front();
+    try
+    {
+      if (entry.clus == 0 || !MapFileRange(file, 0, entry.size, spans))
+        return false;
+    }
+    catch (std::exception &e)
+    {
+      return false;
+    }
 
-  char value[12];
-  value[11] = '\0';
-  std::transform(name.begin(), name.end(), name.begin(), 
-                ::toupper);
+    for (Span& span : spans)
+      mapped += span.len;
+    if (mapped < entry.size)
+      return false;
 
-  for (size_t i = 0; i < 11; ++i)
-  {
-    if (i >= name.length())
-      value[i] = ' ';
-    else
-      value[i] = name[i];
+    for (Span& span : spans)
+    {
+      VisitSpan(span, [&crc] (const uint8_t* data, size_t len)
+      {
+        for (size_t i = 0; i < len; ++i)
+          crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        return true;
+      });
+    }
   }
+  sum = crc ^ 0xFFFFFFFF;
+  return true;
+}
 
-  entry.name = value;
-  entry.attr = attr;
-  entry.SetClus(0);
-  entry.size = 0;
+// Prints the lines gathered by each worker in sorted order
+static void PrintSorted(std::ostream& out, 
+                        std::vector<std::vector<std::string>>& lines)
+{
+  std::vector<std::string> all;
 
-  delete list;
-  return new FileEntry(entry);
+  for (std::vector<std::string>& part : lines)
+    all.insert(all.end(), part.begin(), part.end());
+
+  std::sort(all.begin(), all.end());
+
+  for (std::string& line : all)
+    out << line << '\n';
 }
 
-void Filesys::Fsinfo(std::vector<std::string>& argv)
+void Filesys::Lsr(std::vector<std::string>& argv)
 {
-  if (argv.size() != 0)
+  uint32_t cluster;
+  std::string path;
+
+  if (argv.size() > 1)
   {
-    std::cout << "usage: fsinfo" << std::endl;
+    Fail() << "usage: lsr [directory_name]" << '\n';
     return;
   }
-  else
-  {
-    uint32_t sec = GetNFreeClus() * finfo_.SecPerClus;
-    std::cout << "  Bytes Per Sector:       " << finfo_.BytesPerSec <<
-    std::endl << "  Sectors Per Cluster:    " << finfo_.SecPerClus <<
-    std::endl << "  Total Sectors:          " << finfo_.TotSec <<
-    std::endl << "  Number of FATs:         " << finfo_.NumFats <<
-    std::endl << "  Sectors Per Fat:        " << finfo_.FATSz32 <<
-    std::endl << "  Number of Free Sectors: " << sec <<
-    std::endl;
-  }
+
+  if (!GetTreeRoot(argv, 0, cluster, path))
+    return;
+
+  std::vector<std::vector<std::string>> lines(GetPool().Size());
+
+  if (!WalkTree(cluster, path, 
+        [&lines] (size_t worker, const std::string& p, DirEntry& e) 
+        { lines[worker].push_back(e.IsDir() ? p + "/" : p); }))
+    Fail() << "Error: Part of the tree could not be read" << '\n';
+
+  PrintSorted(Out(), lines);
 }
 
-void Filesys::Ls(std::vector<std::string>& argv)
+void Filesys::Du(std::vector<std::string>& argv)
 {
-  std::string target;
-  uint32_t currDirClus = cwd_;
+  uint32_t cluster;
+  std::string path;
 
-  if (argv.size() < 1)
-  {
-    target = ".";
-  }
-  else if (argv.size() == 1)
+  if (argv.size() > 1)
   {
-    target = argv[0];
-  }
-  else
-  {
-    std::cout << "usage: ls [directory_name]" << std::endl;
+    Fail() << "usage: du [directory_name]" << '\n';
     return;
   }
 
-  std::list<std::string> list = ParseAddress(target);
-
-  try
-  {
-    currDirClus = NavToDir(list, 0, list.size());
-  }
-  catch(std::exception &e)
-  {
-    std::cout << "Error: Invalid Directory" << std::endl;
+  if (!GetTreeRoot(argv, 0, cluster, path))
     return;
-  }
 
-  if (currDirClus == 0)
-    return;
+  struct Totals
+  {
+    uint64_t files, dirs, bytes, clusters;
+  };
+  std::vector<Totals> totals(GetPool().Size(), Totals());
+  uint32_t clusSize = finfo_.ClusBytes;
 
-  std::list<FileEntry>* display = GetFileList(currDirClus);
+  if (!WalkTree(cluster, path, 
+        [&] (size_t worker, const std::string&, DirEntry& e) 
+        {
+          Totals& t = totals[worker];
+          if (e.IsDir())
+          {
+            ++t.dirs;
+            uint32_t c = e.clus;
+            while (c >= 2 && c < FATEND && t.clusters < fat_.entries.size())
+            {
+              ++t.clusters;
+              c = GetNextClus(c);
+            }
+          }
+          else
+          {
+            ++t.files;
+            t.bytes += e.size;
+            t.clusters += ((uint64_t)e.size + clusSize - 1) >> 
+                          finfo_.ClusBytesShift;
+          }
+        }))
+    Fail() << "Error: Part of the tree could not be read" << '\n';
 
-  for (FileEntry i : *display)
+  Totals sum = Totals();
+  for (Totals& t : totals)
   {
-    std::cout << i.GetShortName() << " ";
+    sum.files += t.files;
+    sum.dirs += t.dirs;
+    sum.bytes += t.bytes;
+    sum.clusters += t.clusters;
   }
 
-  if (display->size() > 0)
-    std::cout << std::endl;
-
-  delete display;
+  Out() << "  Files:           " << sum.files << '\n'
+        << "  Directories:     " << sum.dirs << '\n'
+        << "  Bytes:           " << sum.bytes << '\n'
+        << "  Bytes Allocated: " << sum.clusters * clusSize << '\n';
 }
 
-void Filesys::Cd(std::vector<std::string>& argv)
+void Filesys::Find(std::vector<std::string>& argv)
 {
-  std::string target;
-  uint32_t currDirClus = cwd_;
+  uint32_t cluster;
+  std::string path;
 
-  if (argv.size() < 1)
-  {
-    target = "/";
-  }
-  else if (argv.size() == 1)
+  if (argv.size() < 1 || argv.size() > 2)
   {
-    target = argv[0];
-  }
-  else
-  {
-    std::cout << "usage: cd [directory_name]" << std::endl;
+    Fail() << "usage: find <entry_name> [directory_name]" << '\n';
     return;
   }
 
-  std::list<std::string> list = ParseAddress(target);
-
-  try
-  {
-    currDirClus = NavToDir(list, 0, list.size());
-  }
-  catch(std::exception &e)
-  {
-    std::cout << "Error: Invalid Directory" << std::endl;
+  if (!GetTreeRoot(argv, 1, cluster, path))
     return;
-  }
 
-  cwd_ = currDirClus;
-  location_ = GenPathName(cwd_);
+  std::string name = argv[0];
+  std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+  std::vector<std::vector<std::string>> lines(GetPool().Size());
+
+  if (!WalkTree(cluster, path, 
+        [&] (size_t worker, const std::string& p, DirEntry& e) 
+        { 
+          if (e.GetShortName() == name || 
+              FoldName(p.substr(p.rfind('/') + 1)) == name)
+            lines[worker].push_back(p);
+        }))
+    Fail() << "Error: Part of the tree could not be read" << '\n';
+
+  PrintSorted(Out(), lines);
 }
 
-void Filesys::Size(std::vector<std::string>& argv)
+void Filesys::Cksum(std::vector<std::string>& argv)
 {
-  if (argv.size() != 1)
+  uint32_t cluster;
+  std::string path;
+
+  if (argv.size() > 1)
   {
-    std::cout << "usage: size <entry_name>" << std::endl;
+    Fail() << "usage: cksum [directory_name]" << '\n';
     return;
   }
-  else
-  {
-    std::list<std::string> address = ParseAddress(argv[0]);
-    uint32_t location = cwd_;
 
-    try
-    {
-      location = NavToDir(address, 0, address.size() - 1);
-    }
-    catch (std::exception &e)
-    {
-      std::cout << "Invalid directory" << std::endl;
-    }
+  if (!GetTreeRoot(argv, 0, cluster, path))
+    return;
 
-    std::list<FileEntry>* list = GetFileList(location);
-    std::string name = address.back();
+  std::vector<std::vector<std::string>> lines(GetPool().Size());
+  std::atomic<bool> broken(false);
 
-    bool found = false;
+  if (!WalkTree(cluster, path, 
+        [&] (size_t worker, const std::string& p, DirEntry& e) 
+        { 
+          uint32_t sum;
 
-    for (FileEntry e : *list)
-    {
-      if (e.GetShortName() == name)
-      {
-        uint32_t currentCluster = e.clus;
-        size_t count = 0;
+          if (e.IsDir())
+            return;
 
-        do
-        {
-          currentCluster = GetNextClus(currentCluster);
-          ++count;
-        } while (currentCluster < FATEND);
+          if (!FileCrc(e, sum))
+          {
+            lines[worker].push_back(p + " Error: Cluster chain is broken");
+            broken = true;
+            return;
+          }
 
-        std::cout << count * finfo_.BytesPerSec * finfo_.SecPerClus
-        << std::endl;
-        found = true;
-        break;
-      }
-    }
+          std::ostringstream line;
+          line << p << " " << std::hex << std::setw(8) 
+               << std::setfill('0') << sum << std::dec << " " << e.size;
+          lines[worker].push_back(line.str());
+        }))
+    Fail() << "Error: Part of the tree could not be read" << '\n';
 
-    if (!found)
-      std::cout << "Invalid Filename" << std::endl;
+  PrintSorted(Out(), lines);
 
-    delete list;
-  }
+  if (broken)
+    Current().failed = true;
 }
 
-void Filesys::Open(std::vector<std::string>& argv)
+// Returns one past the highest cluster of the data region, GetEndOfFat
+// gives the highest cluster itself
+uint32_t Filesys::GetClusLimit()
 {
-  if (argv.size() != 2)
-  {
-    std::cout << "usage: open <file_name> <mode>" << std::endl;
-    return;
-  }
-  else
+  return std::min<uint64_t>(fat_.entries.size(), 
+                            (uint64_t)finfo_.GetEndOfFat() + 1);
+}
+
+// Compares every FAT copy with the first one, a chunk of the FAT per task.
+// Each differing entry is reported against its cluster
+void Filesys::CheckFatCopies(std::vector<std::vector<std::string>>& found)
+{
+  WorkPool& pool = GetPool();
+  uint32_t nEntries = fat_.entries.size();
+  size_t first = (size_t)finfo_.RsvdSecCnt * finfo_.BytesPerSec;
+
+  for (uint32_t copy = 1; copy < finfo_.NumFats; ++copy)
   {
-    std::string name = argv[0];
-    uint32_t location = cwd_;
-    uint32_t openPermission = 0;
+    size_t other = first + (size_t)copy * finfo_.FATSz * finfo_.BytesPerSec;
 
-    if (argv[1] == "rw")
-    {
-      openPermission = READ | WRITE;
-    }
-    else if (argv[1] == "r")
+    for (uint32_t begin = 0; begin < nEntries; begin += CHECK_CHUNK)
     {
-      openPermission = READ;
-    }
-    else if (argv[1] == "w")
-    {
-      openPermission = WRITE;
-    }
-    else
-    {
-      std::cout << "Invalid Permission" << std::endl;
-      return;
+      uint32_t end = std::min<uint64_t>(nEntries, 
+                                        (uint64_t)begin + CHECK_CHUNK);
+      pool.Submit([this, &found, first, other, copy, begin, end] 
+                  (size_t worker)
+      {
+        // Both copies are read a chunk at a time into entries in host 
+        // order, whichever backend holds the image
+        size_t n = end - begin;
+        std::vector<uint32_t> a(n), b(n);
+
+        ReadValue(a.data(), n, first + (size_t)begin * 4, 4);
+        ReadValue(b.data(), n, other + (size_t)begin * 4, 4);
+
+        for (size_t i = 0; (i = FatFindDiff(a.data(), b.data(), i, n)) < n; 
+             ++i)
+        {
+          std::ostringstream line;
+          line << "FAT " << copy + 1 << " differs from FAT 1 at cluster " 
+               << begin + i << ": " << b[i] << " != " << a[i];
+          found[worker].push_back(line.str());
+        }
+      });
     }
+  }
+  pool.Wait();
+}
 
-    std::list<FileEntry>* list = GetFileList(location);
-    bool found = false;
+// Follows the chain of every entry below the root, marking each cluster
+// it owns. A cluster marked twice is cross-linked, a chain that ends early
+// or runs past the size of its file does not match that size
+void Filesys::CheckChains(std::vector<std::atomic<uint64_t>>& owned,
+                          std::vector<std::vector<std::string>>& crossed,
+                          std::vector<std::vector<std::string>>& broken,
+                          std::vector<std::vector<std::string>>& sized)
+{
+  uint32_t clusSize = finfo_.ClusBytes;
+  uint32_t end = GetClusLimit();
+
+  // Marks chain from start, returns its length or UINT32_MAX if it does
+  // not end properly
+  auto markChain = [&] (size_t worker, const std::string& path, 
+                        uint32_t start)
+  {
+    uint32_t length = 0;
+    uint32_t c = start;
 
-    for (FileEntry e : openTable_)
+    while (c < FATEND)
     {
-      if (e.GetShortName() == name)
+      if (c < 2 || c >= end || length >= end)
       {
-        std::cout << "File Already Open" << std::endl;
-        delete list;
-        return;
+        std::ostringstream line;
+        line << path << ": chain leaves the FAT at cluster " << c;
+        broken[worker].push_back(line.str());
+        return UINT32_MAX;
+      }
+
+      uint64_t bit = (uint64_t)1 << (c % 64);
+      if (owned[c / 64].fetch_or(bit) & bit)
+      {
+        std::ostringstream line;
+        line << path << ": cluster " << c << " is cross-linked";
+        crossed[worker].push_back(line.str());
+        return UINT32_MAX;
+      }
+
+      uint32_t next = fat_.entries[c] & FATMASK;
+      if (next == 0 || next == FATBAD)
+      {
+        std::ostringstream line;
+        line << path << ": cluster " << c << " is marked " 
+             << (next == 0 ? "free" : "bad");
+        broken[worker].push_back(line.str());
+        return UINT32_MAX;
       }
+
+      ++length;
+      c = next;
     }
+    return length;
+  };
+
+  markChain(0, "/", finfo_.RootClus);
 
-    for (FileEntry e : *list)
+  WalkTree(finfo_.RootClus, "/", 
+    [&] (size_t worker, const std::string& path, DirEntry& e)
     {
-      if (e.GetShortName() == name)
+      if (e.clus == 0)
       {
-        if ((e.attr & DIRECT) ==  DIRECT)
+        if (!e.IsDir() && e.size != 0)
         {
-          std::cout << "Error: Cannot Open Directory" << std::endl;
-          delete list;
-          return;
+          std::ostringstream line;
+          line << path << ": size is " << e.size << " but no clusters";
+          sized[worker].push_back(line.str());
         }
-        e.openInfo = openPermission;
-        openTable_.push_back(e);
-        found = true;
-        break;
+        return;
       }
-    }
 
-    if (!found)
-      std::cout << "Invalid Filename" << std::endl;
+      uint32_t length = markChain(worker, path, e.clus);
+      uint64_t expected = ((uint64_t)e.size + clusSize - 1) >> 
+                          finfo_.ClusBytesShift;
 
-    delete list;
-  }
+      if (length != UINT32_MAX && !e.IsDir() && length != expected)
+      {
+        std::ostringstream line;
+        line << path << ": size is " << e.size << " but chain has " 
+             << length << " clusters";
+        sized[worker].push_back(line.str());
+      }
+    });
 }
 
-void Filesys::Close(std::vector<std::string>& argv)
+// Prints the first problems of one kind and returns how many there were
+static size_t ReportProblems(std::ostream& out, const char* kind, 
+                             std::vector<std::vector<std::string>>& found)
 {
-  if (argv.size() != 1)
-  {
-    std::cout << "Usage: Close <file_name>" << std::endl;
-    return;
-  }
-  else
-  {
-    std::list<FileEntry>::iterator iter = openTable_.begin(); 
-    std::string name = argv[0];
+  std::vector<std::string> all;
 
-    while (iter != openTable_.end())
-    {
-      if ((*iter).GetShortName() == name)
-      {
-        openTable_.erase(iter);
-        return;
-      }
-      ++iter;
-    }
-    std::cout << "File not open" << std::endl;
-  }
+  for (std::vector<std::string>& part : found)
+    all.insert(all.end(), part.begin(), part.end());
+
+  if (all.empty())
+    return 0;
+
+  std::sort(all.begin(), all.end());
+  out << kind << ": " << all.size() << '\n';
+
+  for (size_t i = 0; i < all.size() && i < CHECK_REPORT_MAX; ++i)
+    out << "  " << all[i] << '\n';
+
+  if (all.size() > CHECK_REPORT_MAX)
+    out << "  ..." << '\n';
+
+  return all.size();
 }
 
-void Filesys::Read(std::vector<std::string>& argv)
+void Filesys::Check(std::vector<std::string>& argv)
 {
-  if (argv.size() != 3)
+  if (argv.size() != 0)
   {
-    std::cout << "Usage: Read <file_name> <start> <num_bytes>"
-              << std::endl;
+    Fail() << "usage: check" << '\n';
     return;
   }
-  else
-  {
-    std::list<FileEntry>::iterator iter = openTable_.begin(); 
-    std::string name = argv[0];
-    bool found = false;
 
-    while (iter != openTable_.end())
+  WorkPool& pool = GetPool();
+  size_t workers = pool.Size();
+  uint32_t end = GetClusLimit();
+  std::vector<std::vector<std::string>> copies(workers), crossed(workers), 
+      broken(workers), sized(workers), lost(workers);
+  std::vector<std::atomic<uint64_t>> owned(fat_.entries.size() / 64 + 1);
+  std::vector<std::atomic<uint64_t>> linked(fat_.entries.size() / 64 + 1);
+
+  CheckFatCopies(copies);
+  CheckChains(owned, crossed, broken, sized);
+
+  // Marks every cluster some other cluster links to, so that the heads of
+  // lost chains can be told apart from their tails
+  for (uint32_t begin = 2; begin < end; begin += CHECK_CHUNK)
+  {
+    uint32_t last = std::min<uint64_t>(end, (uint64_t)begin + CHECK_CHUNK);
+    pool.Submit([this, &linked, begin, last, end] (size_t)
     {
-      if ((*iter).GetShortName() == name)
+      for (uint32_t i = begin; i < last; ++i)
       {
-        if (((*iter).openInfo & READ) != READ)
-        {
-          std::cout << "Error: File not open for reading" 
-                    << std::endl;
-          return;
-        }
-
-        found = true;
-        break;
+        uint32_t next = fat_.entries[i] & FATMASK;
+        if (next >= 2 && next < end)
+          linked[next / 64].fetch_or((uint64_t)1 << (next % 64));
       }
-      ++iter;
-    }
+    });
+  }
+  pool.Wait();
 
-    if (!found)
+  // Collects the start of every allocated chain nothing in the tree owns
+  for (uint32_t begin = 2; begin < end; begin += CHECK_CHUNK)
+  {
+    uint32_t last = std::min<uint64_t>(end, (uint64_t)begin + CHECK_CHUNK);
+    pool.Submit([&, begin, last] (size_t worker)
     {
-      std::cout << "Error: File not open" << std::endl;
-      return;
-    }
-
-    // May need to validate to ensure arguments are numbers
+      for (uint32_t i = begin; i < last; ++i)
+      {
+        uint32_t value = fat_.entries[i] & FATMASK;
+        uint64_t bit = (uint64_t)1 << (i % 64);
 
-    uint32_t start = std::stoi(argv[1]);
-    uint32_t length = std::stoi(argv[2]);
-    char* readIn = new char[length + 1];
-    readIn[length] = '\0';
-    uint32_t amountRead = FileOperate(readIn, start, length, *iter, 
-              &Filesys::ReadValue<char>);
-    for (uint32_t i = 0; i < amountRead; ++i)
-    {
-      std::cout << readIn[i];
-    }
+        if (value == 0 || value == FATBAD || (owned[i / 64] & bit) ||
+            (linked[i / 64] & bit))
+          continue;
 
-    delete[] readIn;
+        uint32_t length = 0;
+        for (uint32_t c = i; c >= 2 && c < end && length < end &&
+             !(owned[c / 64] & ((uint64_t)1 << (c % 64))); ++length)
+          c = fat_.entries[c] & FATMASK;
+
+        std::ostringstream line;
+        line << "chain at cluster " << i << " of " << length 
+             << " clusters";
+        lost[worker].push_back(line.str());
+      }
+    });
+  }
+  pool.Wait();
+
+  size_t problems = 0;
+  problems += ReportProblems(Out(), "FAT copy mismatches", copies);
+  problems += ReportProblems(Out(), "Cross-linked clusters", crossed);
+  problems += ReportProblems(Out(), "Broken chains", broken);
+  problems += ReportProblems(Out(), "Size mismatches", sized);
+  problems += ReportProblems(Out(), "Lost chains", lost);
+
+  STAT_ADD(stats_, FAT_SCANS, 1);
+  uint32_t nFree = end > 2 ? FatCountZero(fat_.entries.data(), 2, end) : 0;
+  // Until the next sync the count kept in memory is the one that counts
+  uint32_t reported = fat_.dirty || !HasFsInfo() ? fat_.freeCount : 
+                      GetNFreeClus();
+
+  if (reported != nFree)
+  {
+    Out() << "Free cluster count: FSInfo has " << reported 
+          << ", FAT has " << nFree << '\n';
+    ++problems;
   }
+
+  if (problems == 0)
+    Out() << "No problems found" << '\n';
+  else
+    Out() << problems << " problems found" << '\n';
 }
 
-void Filesys::Write(std::vector<std::string>& argv)
+// Counts the clusters of the chain at first and the runs of contiguous
+// clusters they make up. Returns 0 if the chain is broken or loops
+uint32_t Filesys::CountRuns(uint32_t first, uint32_t& clusters)
 {
-  if (argv.size() != 3)
+  size_t limit = fat_.entries.size();
+  uint32_t runs = 0;
+  uint32_t prev = 0;
+  uint32_t c = first;
+
+  clusters = 0;
+  while (c >= 2 && c < FATEND)
   {
-    std::cout << "Usage: Write <file_name> <start> <quoted_data>"
-              << std::endl;
-    return;
+    if (c >= limit || clusters >= limit || (fat_.entries[c] & FATMASK) == 0)
+      break;
+
+    if (c != prev + 1)
+      ++runs;
+    ++clusters;
+    prev = c;
+    c = GetNextClus(c);
   }
-  else
+
+  if (c < FATEND)
   {
-    std::list<FileEntry>::iterator iter = openTable_.begin(); 
-    std::string name = argv[0];
-    bool found = false;
+    clusters = 0;
+    return 0;
+  }
+  return runs;
+}
 
-    while (iter != openTable_.end())
-    {
-      if ((*iter).GetShortName() == name)
-      {
-        if (((*iter).openInfo & WRITE) != WRITE)
-        {
-          std::cout << "Error: File not open for writing" 
-                    << std::endl;
-          return;
-        }
+// Copies count clusters starting at from over those starting at to, the
+// two ranges must not overlap
+void Filesys::CopyClusters(uint32_t from, uint32_t to, uint32_t count)
+{
+  size_t len = (size_t)count << finfo_.ClusBytesShift;
+  size_t src = finfo_.GetClusPos(from);
+  size_t dst = finfo_.GetClusPos(to);
 
-        found = true;
-        break;
-      }
-      ++iter;
-    }
+  if (src + len > filesys_size_)
+    throw std::exception();
 
-    if (!found)
-    {
-      std::cout << "Error: File not open" << std::endl;
-      return;
-    }
+  DropRecords(dst, len);
 
-    // May need to validate to ensure arguments are numbers
+  // Mapped images are copied in place
+  if (mFilesys_ != NULL)
+  {
+    STAT_ADD(stats_, BYTES_READ, len);
+    WriteBytes(mFilesys_ + src, len, dst);
+    return;
+  }
 
-    uint32_t start = std::stoi(argv[1]);
-    std::string input = argv[2];
-    uint32_t length = input.length();
+  std::vector<uint8_t> buffer(std::min<size_t>(len, COPY_CHUNK));
 
-    uint32_t totalSize = start + length;
-    uint32_t currAllocated;
-    uint32_t location;
+  for (size_t done = 0; done < len; done += buffer.size())
+  {
+    size_t piece = std::min(buffer.size(), len - done);
+    ReadBytes(buffer.data(), piece, src + done);
+    WriteBytes(buffer.data(), piece, dst + done);
+  }
+}
 
-    if ((*iter).clus == 0)
-    {
-      location = AllocateCluster();
-      (*iter).SetClus(location);
-      (*iter).size = totalSize;
-      SaveFileEntry(*iter);
-      currAllocated = 1;
-    }
-    else
-    {
-      currAllocated = 0;
-      location = (*iter).clus;
-      uint32_t templocat = location;
-      while (1) 
-      {
-        ++currAllocated;
-        if ((templocat = GetNextClus(templocat)) >= FATEND)
-          break;
+// Points the directory record at loc to cluster, leaving the rest of it
+// alone, and brings the name index holding it up to date
+void Filesys::PatchRecordClus(uint32_t loc, uint32_t cluster)
+{
+  std::array<uint8_t, 32> record;
 
-        location = templocat;
-      }
-    }
-    currAllocated *= finfo_.SecPerClus * finfo_.BytesPerSec;
+  ReadRecord(record.data(), loc);
+  StoreLE<uint16_t>(&record[20], cluster >> 16);
+  StoreLE<uint16_t>(&record[26], cluster & 0xFFFF);
+  pendingRecords_[loc] = record;
 
-    if (totalSize > currAllocated)
-    {
-      uint32_t neededClus = 
-                  (uint32_t)ceil((float)(totalSize - currAllocated) /
-                  (finfo_.SecPerClus * finfo_.BytesPerSec));
+  std::lock_guard<std::mutex> guard(cacheLock_);
+  std::unordered_map<uint32_t, uint32_t>::iterator owner = 
+        dirOfClus_.find(GetClusOfLoc(loc));
 
-      for (uint32_t i = 0; i < neededClus; ++i)
-      {
-        location = AllocateCluster(location);
-      }
-    }
+  if (owner == dirOfClus_.end())
+    return;
 
-    if ((*iter).size < totalSize)
-    {
-      (*iter).size = totalSize;
-      SaveFileEntry(*iter);
-    }
+  DirCache& dir = dirCache_[owner->second];
+  std::unordered_map<uint32_t, std::string>::iterator name = 
+        dir.byLoc.find(loc);
 
-    char* writeIn = new char[length + 1];
-    writeIn[length] = '\0';
+  if (name == dir.byLoc.end())
+    return;
 
-    strcpy(writeIn, input.c_str());
-    if (FileOperate(writeIn, start, length, *iter, 
-              &Filesys::WriteValue<char>) == 0)
-    {
-      std::cout << "An error occured" << std::endl;
-    }
+  std::unordered_map<std::string, DirEntry>::iterator found = 
+        dir.byName.find(name->second);
 
-    delete[] writeIn;
-  }
+  if (found != dir.byName.end())
+    found->second.clus = cluster;
 }
 
-void Filesys::Mkdir(std::vector<std::string>& argv)
+// Moves the count clusters of the chain of entry to the free run at 
+// target. The data is copied and synced before the FAT and the records
+// pointing at the chain are changed, and those go out in one flush with
+// the early flush held off, so a crash leaves either the old chain or the
+// new one. Directories also get their . record, the .. records of their
+// subdirectories, and the caches, working directories and open files
+// locating records by their clusters moved along
+void Filesys::MoveChain(DirEntry entry, uint32_t target, uint32_t count)
 {
-  if (argv.size() != 1)
-  {
-    std::cout << "Usage: mkdir <dir_name>" << std::endl;
-    return;
-  }
-  else
-  {
-    std::list<std::string> address = ParseAddress(argv[0]);
-    uint32_t location = cwd_;
+  uint32_t old = entry.clus;
+  bool dir = entry.IsDir();
+  std::vector<Extent> runs;
+  uint32_t c = old;
 
-    try
-    {
-      location = NavToDir(address, 0, address.size() - 1);
-    }
-    catch (std::exception &e)
+  for (uint32_t index = 0; index < count; ++index)
+  {
+    if (!runs.empty() && runs.back().start + runs.back().length == c)
+      ++runs.back().length;
+    else
     {
-      std::cout << "Invalid location" << std::endl;
-      return;
+      Extent run = { index, c, 1 };
+      runs.push_back(run);
     }
+    c = GetNextClus(c);
+  }
 
-    std::string name = address.back();
+  // The batch holds the move alone, and records of a directory waiting
+  // in the write-back reach its clusters before they are copied
+  Flush();
 
-    std::string fixedName; 
-    try
-    {
-      fixedName = ValidateFileName(name);
-    }
-    catch(std::exception &e)
-    {
-      return;
-    }
+  for (Extent& run : runs)
+    CopyClusters(run.start, target + run.index, run.length);
+  storage_->Sync();
+
+  holdFlush_ = true;
 
-    // Other Validations needed
-    FileEntry* entry = AddEntry(location, name, DIRECT);
+  try
+  {
+    LinkRun(target, count, 0xFFFFFFFF);
+    UpdateClusCount([count] (uint32_t value) { return value - count; });
+    STAT_ADD(stats_, CLUS_ALLOCATED, count);
+    PatchRecordClus(entry.entryLoc, target);
 
-    if (entry != NULL)
+    if (dir)
     {
-      uint32_t newCluster = AllocateCluster();
-      if (newCluster != 0)
+      InvalidateDir(old);
+      InvalidatePaths();
+
+      uint8_t record[32];
+      ReadRecord(record, finfo_.GetClusPos(target));
+      if (record[0] == '.' && record[1] == ' ')
+        PatchRecordClus(finfo_.GetClusPos(target), target);
+
+      std::vector<uint32_t> children;
+      for (DirEntry& e : GetFileList(target))
       {
-        entry->SetClus(newCluster);
-        entry->name = fixedName;
-        FileEntry* level = AddEntry(entry->clus,".          ", DIRECT);
-        FileEntry* topLevel = AddEntry(entry->clus,"..         ", DIRECT);
+        std::string name = e.GetShortName();
+        if (e.IsDir() && e.clus >= 2 && name != "." && name != "..")
+          children.push_back(e.clus);
+      }
 
-        if (level != NULL)
-        {
-          level->SetClus(newCluster);
-          SaveFileEntry(*level);
-          delete level;
-        }
-        if (topLevel != NULL)
-        {
-          topLevel->SetClus(location == finfo_.RootClus ? 0 : location);
-          topLevel->entryLoc += 32;
-          SaveFileEntry(*topLevel);
-          delete topLevel;
-        }
-        SaveFileEntry(*entry);
+      for (uint32_t child : children)
+      {
+        DirEntry* up = FindEntry(child, "..");
+        if (up != NULL && up->clus == old)
+          PatchRecordClus(up->entryLoc, target);
       }
-      delete entry;
     }
+
+    // Freed last, once nothing points at the old chain
+    FreeChains(std::vector<uint32_t>(1, old));
+  }
+  catch (std::exception &e)
+  {
+    holdFlush_ = false;
+    throw;
   }
-}
 
-void Filesys::Create(std::vector<std::string>& argv)
-{
-  if (argv.size() != 1)
+  holdFlush_ = false;
+  Flush();
+
+  if (!dir)
   {
-    std::cout << "Usage: create <file_name>" << std::endl;
+    std::unordered_map<uint32_t, std::list<OpenFile>::iterator>::iterator
+          found = openIndex_.find(entry.entryLoc);
+
+    if (found != openIndex_.end())
+      found->second->file.SetClus(target);
     return;
   }
-  else
+
+  // Records inside the directory keep their offset into its chain
+  auto remap = [&] (uint32_t loc)
   {
-    std::list<std::string> address = ParseAddress(argv[0]);
-    uint32_t location = cwd_;
+    if (loc < finfo_.DataPos)
+      return loc;
 
-    try
-    {
-      location = NavToDir(address, 0, address.size() - 1);
-    }
-    catch (std::exception &e)
+    uint32_t clus = GetClusOfLoc(loc);
+    for (Extent& run : runs)
     {
-      std::cout << "Invalid location" << std::endl;
+      if (clus >= run.start && clus < run.start + run.length)
+        return loc - (uint32_t)finfo_.GetClusPos(run.start) + 
+               (uint32_t)finfo_.GetClusPos(target + run.index);
     }
+    return loc;
+  };
 
-    std::string name = address.back();
-    
-    std::string fixedName; 
-    try
-    {
-      fixedName = ValidateFileName(name);
-    }
-    catch(std::exception &e)
-    {
-      return;
-    }
+  openIndex_.clear();
+  for (std::list<OpenFile>::iterator open = openFiles_.begin(); 
+       open != openFiles_.end(); ++open)
+  {
+    open->file.entryLoc = remap(open->file.entryLoc);
+    open->file.lfnLoc = remap(open->file.lfnLoc);
+    openIndex_[open->file.entryLoc] = open;
+  }
 
-    FileEntry* entry = AddEntry(location, name, 0);
+  for (Session& session : sessions_)
+  {
+    if (session.cwd == old)
+      session.cwd = target;
 
-    if (entry != NULL)
-    {
-      entry->SetClus(0);
-      entry->name = fixedName;
-      SaveFileEntry(*entry);
-      delete entry;
-    }
+    session.openByLoc.clear();
+    for (auto& open : session.openFiles)
+      session.openByLoc[open.second.open->file.entryLoc] = open.first;
   }
 }
 
-void Filesys::Undelete(std::vector<std::string>&)
+// Remembers the last path defrag finished below root
+void Filesys::SaveDefragCursor(const std::string& root, 
+                               const std::string& done)
 {
-  uint32_t location = cwd_;
-  uint32_t endOfFat = finfo_.GetEndOfFat();
-  uint32_t maxCount = 99;
-  uint16_t count = 0;
+  std::ofstream out(defragName_.c_str(), std::ios::trunc);
+  out << root << '\n' << done << '\n';
+}
 
-  std::list<FileEntry>* allist = GetFileList(location);
+void Filesys::Frag(std::vector<std::string>& argv)
+{
+  uint32_t cluster;
+  std::string path;
 
-  for (FileEntry e : *allist)
+  if (argv.size() > 1)
   {
-    if (e.GetShortName().substr(0, 6) == "recvd_")
-      ++count;
+    Fail() << "usage: frag [directory_name]" << '\n';
+    return;
   }
 
-  delete allist;
-
-  if (count > maxCount)
+  if (!GetTreeRoot(argv, 0, cluster, path))
     return;
 
-  std::list<FileEntry>* delist = GetFileList(location, true);
-
-  for (FileEntry e : *delist)
+  struct Totals
   {
-    if ((unsigned char)e.name[0] == 0xe5)
-    {
-      uint32_t clusterCount = 1;
-
-      if ((e.attr & DIRECT) != DIRECT)
-      {
-        clusterCount = ceil((float)e.size / (finfo_.BytesPerSec * 
-                                             finfo_.SecPerClus));
-      }
+    uint64_t files, fragFiles, dirs, fragDirs, runs, chains;
+  };
+  std::vector<Totals> totals(GetPool().Size(), Totals());
+  std::vector<std::vector<std::string>> lines(GetPool().Size());
 
-      uint32_t currentCluster = e.clus;
-      uint32_t nextCluster;
-      bool boundError = false;
-
-      if (currentCluster != 0)
-      {
-        while (GetNextClus(currentCluster) != 0)
+  if (!WalkTree(cluster, path, 
+        [&] (size_t worker, const std::string& p, DirEntry& e) 
         {
-          ++currentCluster;
-          if (currentCluster > endOfFat)
-          {
-            boundError = true;
-            break;
-          }
-        }
+          Totals& t = totals[worker];
+          uint32_t clusters;
+          uint32_t runs = e.clus >= 2 ? CountRuns(e.clus, clusters) : 0;
 
-        nextCluster = currentCluster + 1;
+          if (e.IsDir())
+            ++t.dirs;
+          else
+            ++t.files;
 
-        if (boundError)
-          continue;
+          if (runs == 0)
+            return;
 
-        e.clus = currentCluster;
+          t.runs += runs;
+          ++t.chains;
 
-        for (uint32_t i = 0; i < clusterCount; ++i)
-        {
-          if (i == clusterCount - 1)
-          {
-            SetNextClus(currentCluster, 0xFFFFFFFF);
-            UpdateClusCount([] (uint32_t value) {return value - 1;});
-          }
-          else
+          if (runs > 1)
           {
-            while (GetNextClus(nextCluster) != 0)
-            {
-              ++nextCluster;
-              if (nextCluster > endOfFat)
-              {
-                boundError = true;
-                break;
-              }
-            }
-
-            if (boundError)
-              break;
-            SetNextClus(currentCluster, nextCluster);
-            UpdateClusCount([] (uint32_t value) {return value - 1;});
-            currentCluster = nextCluster;
-            ++nextCluster;
+            ++(e.IsDir() ? t.fragDirs : t.fragFiles);
+            lines[worker].push_back(p + (e.IsDir() ? "/" : "") + ": " +
+                                    std::to_string(runs) + " runs, " +
+                                    std::to_string(clusters) + " clusters");
           }
-        }
-      }
+        }))
+    Fail() << "Error: Part of the tree could not be read" << '\n';
 
-      ++count;
-      std::ostringstream number;
-      number << "RECVD_" <<  count;
-      size_t padding = 11 - number.str().length();
-      e.name = number.str();
+  PrintSorted(Out(), lines);
 
-      for (size_t i = 0; i < padding; ++i)
-        e.name += ' ';
+  Totals sum = Totals();
+  for (Totals& t : totals)
+  {
+    sum.files += t.files;
+    sum.fragFiles += t.fragFiles;
+    sum.dirs += t.dirs;
+    sum.fragDirs += t.fragDirs;
+    sum.runs += t.runs;
+    sum.chains += t.chains;
+  }
 
-      SaveFileEntry(e);
+  // Free space of the whole image, as runs of free clusters
+  uint64_t freeClus = 0;
+  uint64_t freeRuns = 0;
+  uint32_t largest = 0;
+  uint32_t c = 2;
 
-      if (count >= maxCount)
-        break;
-    }
+  while ((c = fat_.FindFreeIn(c, fat_.endOfFat)) != 0)
+  {
+    uint32_t length = fat_.RunLength(c, fat_.endOfFat);
+    freeClus += length;
+    ++freeRuns;
+    largest = std::max(largest, length);
+    c += length;
   }
-  delete delist;
+
+  std::ostream& out = Out();
+  std::ios::fmtflags flags = out.flags();
+  std::streamsize precision = out.precision();
+
+  out << "  Files:           " << sum.files << ", " << sum.fragFiles
+      << " fragmented" << '\n'
+      << "  Directories:     " << sum.dirs << ", " << sum.fragDirs
+      << " fragmented" << '\n'
+      << "  Runs per chain:  " << std::fixed << std::setprecision(2)
+      << (sum.chains == 0 ? 0.0 : (double)sum.runs / sum.chains) 
+      << '\n'
+      << "  Free Clusters:   " << freeClus << " in " << freeRuns
+      << " runs, largest " << largest << '\n';
+
+  out.flags(flags);
+  out.precision(precision);
 }
 
-void Filesys::Rm(std::vector<std::string>& argv)
+void Filesys::Defrag(std::vector<std::string>& argv)
 {
-  uint32_t location = cwd_;
+  double rate = 0;
+  double window = -1;
+  bool compact = false;
+  bool valid = true;
+  size_t index = 0;
 
-  if (argv.size() == 0)
+  try
+  {
+    for (; index < argv.size() && argv[index].compare(0, 1, "-") == 0; 
+         ++index)
+    {
+      if (argv[index] == "-c")
+        compact = true;
+      else if (argv[index] == "-r" && index + 1 < argv.size())
+        rate = std::stod(argv[++index]) * 1024;
+      else if (argv[index] == "-t" && index + 1 < argv.size())
+        window = std::stod(argv[++index]);
+      else
+        throw std::invalid_argument(argv[index]);
+    }
+  }
+  catch (std::exception &e)
+  {
+    valid = false;
+  }
+
+  uint32_t cluster;
+  std::string path;
+
+  if (!valid || index + 1 < argv.size() || rate < 0)
   {
-    std::cout << "Usage: rm <file_name>\n";
+    Fail() << "usage: defrag [-r KiB_per_sec] [-t seconds] [-c] "
+           << "[directory_name]" << '\n';
     return;
   }
 
-  // maybe have code to parse the input in case file has leading dir
-  // for loop to allow removing multiple files at once
-  for (uint32_t i=0; i < argv.size(); i++)
+  if (!GetTreeRoot(argv, index, cluster, path))
+    return;
+
+  // Paths are kept absolute so a resumed run finds its place from
+  // anywhere
+  std::string root = GenPathName(cluster);
+  std::vector<std::vector<std::string>> lines(GetPool().Size());
+
+  if (!WalkTree(cluster, root, 
+        [&lines] (size_t worker, const std::string& p, DirEntry&) 
+        { lines[worker].push_back(p); }))
   {
-    std::list<FileEntry>::iterator iter = openTable_.begin();
-    std::string name = argv[i];
+    Fail() << "Error: Part of the tree could not be read" << '\n';
+    return;
+  }
 
-    // to check if file is open, and closing befire removing
-    while(iter != openTable_.end())
+  std::vector<std::string> paths;
+  for (std::vector<std::string>& part : lines)
+    paths.insert(paths.end(), part.begin(), part.end());
+  std::sort(paths.begin(), paths.end());
+
+  std::string done;
+  std::ifstream cursor(defragName_.c_str());
+  std::string cursorRoot;
+
+  if (std::getline(cursor, cursorRoot) && cursorRoot == root)
+    std::getline(cursor, done);
+  cursor.close();
+
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point start = Clock::now();
+  uint64_t moved = 0;
+  uint64_t movedClus = 0;
+  uint64_t skipped = 0;
+  uint64_t copied = 0;
+  bool stopped = false;
+  bool lost = false;
+
+  for (std::string& p : paths)
+  {
+    if (!done.empty() && p <= done)
+      continue;
+
+    double elapsed = std::chrono::duration<double>(Clock::now() - 
+                                                   start).count();
+    if (window >= 0 && elapsed >= window)
+    {
+      stopped = true;
+      break;
+    }
+
+    // Hold off until the copying is back under the rate, letting other
+    // commands at the tree meanwhile. The pass ends if they took its 
+    // directory away
+    if (rate > 0 && copied / rate > elapsed)
     {
-      if ((*iter).GetShortName() == name)
+      scope_->Pause(copied / rate - elapsed);
+
+      std::list<std::string> address = ParseAddress(root);
+      try
       {
-        std::vector<std::string> list;
-        list.push_back(argv[i]);
-        Close(list);
+        NavToDir(address, 0, address.size());
+      }
+      catch (std::exception &e)
+      {
+        lost = true;
         break;
       }
-      iter++;
     }
 
-    std::list<FileEntry>* list = GetFileList(location);
-    uint32_t count = 0;
-    bool found = false;
+    // The tree may have changed since the walk, so each path is looked
+    // up again
+    std::list<std::string> address = ParseAddress(p);
+    DirEntry* entry = NULL;
 
-    for (FileEntry e : *list)
+    try
     {
-      if (e.GetShortName() == name)
-      {
-        if ((e.attr & DIRECT) == DIRECT)
-          continue;
+      uint32_t location = NavToDir(address, 0, address.size() - 1);
+      entry = FindEntry(location == 0 ? finfo_.RootClus : location, 
+                    address.back());
+    }
+    catch (std::exception &e)
+    {
+    }
 
-        found = true;
+    done = p;
 
-        if (e.clus != 0)
-        {
-          uint32_t currCluster = e.clus;
-          uint32_t lastCluster;
+    uint32_t clusters;
+    uint32_t runs = entry != NULL && entry->clus >= 2 ? 
+                    CountRuns(entry->clus, clusters) : 0;
 
-          do
-          {
-            lastCluster = currCluster;
-            currCluster = GetNextClus(currCluster);
-            SetNextClus(lastCluster, 0);
-            UpdateClusCount([] (uint32_t value) { return value + 1;});
-            count++;
-          } while (currCluster < FATEND);
-        } 
-        
-        e.name[0] = 0xe5;
-        SaveFileEntry(e);
-        break;
-      }
-      iter++;
-    }
+    if (runs == 0 || entry->clus == finfo_.RootClus)
+      continue;
 
-    delete list;
+    uint32_t target = fat_.FindRun(clusters, 2);
 
-    if (!found)
+    if (runs == 1 && (!compact || target == 0 || target > entry->clus))
+      continue;
+
+    if (target == 0)
     {
-      std::cout << "File " << name << " not found!\n";
-      return;
+      ++skipped;
+      continue;
     }
 
+    MoveChain(*entry, target, clusters);
+    ++moved;
+    movedClus += clusters;
+    copied += (uint64_t)clusters << finfo_.ClusBytesShift;
+    SaveDefragCursor(root, done);
   }
+
+  if (stopped)
+    SaveDefragCursor(root, done);
+  else
+    unlink(defragName_.c_str());
+
+  if (lost)
+    Fail() << "Error: " << root << " was removed while defrag waited" 
+           << '\n';
+
+  Out() << "Moved " << moved << " chains, " << movedClus 
+        << " clusters" << '\n';
+
+  if (skipped > 0)
+    Out() << skipped << " fragmented chains had no free run to fit in"
+          << '\n';
+
+  if (stopped)
+    Out() << "Stopped at the time limit, run defrag again to resume"
+          << '\n';
 }
 
-void Filesys::Rmdir(std::vector<std::string>& argv)
+void Filesys::Sync(std::vector<std::string>& argv)
 {
-  if (argv.size() != 1)
+  if (argv.size() != 0)
   {
-    std::cout << "usage: rmdir <dir_name>" << std::endl;
+    Fail() << "usage: sync" << '\n';
     return;
   }
-  else
-  {
-    std::string name = argv[0];
-    uint32_t location = cwd_;
-    std::list<FileEntry>* list = GetFileList(location);
-    FileEntry* entry = NULL;
 
-    bool found = false;
-    if (name[0] != '.')
-    {
-      for (FileEntry e : *list)
-      {
-        if (e.GetShortName() == name)
-        {
-          if ((e.attr & DIRECT) == DIRECT)
-          {
-            found = true;
-            entry = new FileEntry(e);
-          }
-          break;
-        }
-      }
-    }
-
-    delete list;
+  fat_.dirty = true;
+  Flush();
+}
 
-    if (!found)
-    {
-      std::cout << "Invalid Filename" << std::endl;
-      return;
-    }
+void Filesys::Stats(std::vector<std::string>& argv)
+{
+  bool reset = false;
+  bool json = false;
 
-    list = GetFileList(entry->clus);
-    
-    if (list->size() > 2)
+  for (std::string& arg : argv)
+  {
+    if (arg == "reset" && !reset)
+      reset = true;
+    else if (arg == "json" && !json)
+      json = true;
+    else
     {
-      std::cout << "Directory must be empty" << std::endl;
-      delete list;
-      delete entry;
+      Fail() << "usage: stats [reset] [json]" << '\n';
       return;
     }
+  }
 
-    entry->name[0] = 0xe5;
-    SaveFileEntry(*entry);
-
-    if (entry->clus != 0)
-    {
-      uint32_t currCluster = entry->clus;
-      uint32_t lastCluster;
-
-      do
-      {
-        lastCluster = currCluster;
-        currCluster = GetNextClus(currCluster);
-        SetNextClus(lastCluster, 0);
-        UpdateClusCount([] (uint32_t value) { return value + 1;});
-      } while (currCluster < FATEND);
-    }
+#if FILESYS_STATS
+  if (json)
+    stats_.PrintJson(Out());
+  else
+    stats_.Print(Out());
 
-    delete entry;
-    delete list;
-  }
+  if (reset)
+    stats_.Reset();
+#else
+  Fail() << "Error: Built without FILESYS_STATS" << '\n';
+#endif
 }
 
 void Filesys::Help(std::vector<std::string>&)
 {
-  std::cout << " Enter any of the following commands:" << std::endl;
+  Out() << " Enter any of the following commands:" << '\n';
   for (auto item : functions_)
   {
-    std::cout << "   " << item.first << std::endl;
+    Out() << "   " << item.first << '\n';
   }
 }
@@ -9,23 +9,45 @@
 #include <iomanip>
 #include <exception>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <array>
 #include <functional>
+#include <sys/uio.h>
+#include <workpool.h>
+#include <storage.h>
+#include <ioengine.h>
+#include <metrics.h>
 
 class Filesys
 {
   public:
-    Filesys(std::string);
-    bool CallFunct(std::string&, std::vector<std::string>&);
+    struct Session;
+
+    // The journal and the defrag cursor are kept in the directory given,
+    // or beside the image if there is none
+    Filesys(std::string, Storage::Kind = Storage::AUTO, std::string = "");
+    Session* OpenSession(std::ostream&);
+    void CloseSession(Session*);
+    bool CallFunct(std::string&, std::vector<std::string>&, 
+                   Session* = NULL);
+    bool Failed(Session* = NULL);
     bool HasError();
     void Validate();
-    std::string GetLocation();
+    std::string GetLocation(Session* = NULL);
+    bool ReadExtents(std::string, uint32_t, uint32_t, 
+                     std::vector<struct iovec>&, Session* = NULL);
     ~Filesys();
 
   private:
+    // Drives the internals directly to time them
+    friend class Bench;
+
+    // Start of the image if the backend maps it, NULL otherwise
     uint8_t* mFilesys_;
     size_t filesys_size_;
     std::string fname_;
-    int fd_;
+    Storage* storage_;
     bool error_;
     std::map<std::string, 
          std::function<void (Filesys&, 
@@ -65,6 +87,16 @@ class Filesys
         uint32_t RootClus;
         uint32_t FsInfo;
         uint32_t TotSec;
+        // Worked out once at mount. Sector and cluster sizes are powers of
+        // two, so addresses come from shifts and masks
+        uint32_t SecShift;
+        uint32_t ClusShift;
+        uint32_t ClusBytes;
+        uint32_t ClusBytesShift;
+        uint64_t DataPos;
+
+        void SetGeometry();
+        uint64_t GetClusPos(uint32_t);
 
         uint32_t GetFirstSectorOfClus(uint32_t);
         uint32_t GetThisFatSecN(uint32_t);
@@ -72,6 +104,107 @@ class Filesys
         uint32_t GetEndOfFat();
     };
 
+    // Run of contiguous clusters starting at cluster index within a file
+    struct Extent
+    {
+        uint32_t index;
+        uint32_t start;
+        uint32_t length;
+    };
+
+    // In-memory copy of the first FAT with a bitmap of free clusters. The
+    // FAT copies on disk only catch up on the blocks of 64 entries marked
+    // in dirtyMap when the write-back batch is flushed. The free count and
+    // next free cluster stand in for FSInfo, which is written back in the
+    // same batch once dirty is set
+    struct FatCache
+    {
+        std::vector<uint32_t> entries;
+        std::vector<uint64_t> freeMap;
+        std::vector<uint64_t> dirtyMap;
+        size_t dirtyBlocks;
+        uint32_t nextFree;
+        // One past the highest cluster of the data region
+        uint32_t endOfFat;
+        uint32_t freeCount;
+        bool dirty;
+
+        void Set(uint32_t, uint32_t);
+        uint32_t FindFreeIn(uint32_t, uint32_t);
+        uint32_t FindFree(uint32_t);
+        uint32_t RunLength(uint32_t, uint32_t);
+        uint32_t FindRun(uint32_t, uint32_t);
+        bool Reserve(uint32_t, uint32_t, std::vector<Extent>&);
+    };
+
+    // Byte range of the filesystem image
+    struct Span
+    {
+        size_t pos;
+        size_t len;
+    };
+
+    // Compact copy of a directory entry as stored on disk. Entries with a
+    // long name keep the location of its first record, and where it sits
+    // decoded in the names of the list or index holding the entry
+    struct DirEntry
+    {
+        char name[11];
+        uint8_t attr;
+        uint32_t clus;
+        uint32_t size;
+        uint32_t entryLoc;
+        uint32_t lfnLoc;
+        uint32_t longPos;
+        uint32_t longLen;
+
+        std::string GetShortName() const;
+        std::string GetLongName(const std::string&) const;
+        std::string GetName(const std::string&) const;
+        bool IsDir() const;
+    };
+
+    // Records of a long name read so far, waiting for the short entry
+    // they belong to
+    struct LfnState
+    {
+        std::vector<uint16_t> chars;
+        uint32_t loc;
+        uint8_t sum;
+        uint8_t next;
+
+        void Reset();
+        void Feed(const uint8_t*, uint32_t);
+        bool Match(const uint8_t*, DirEntry&, std::string&);
+    };
+
+    // Contiguous, move-only listing of a directory, with the long names of
+    // its entries packed in one buffer. Its storage is taken from the 
+    // arena of the calling thread and handed back when done
+    class DirList
+    {
+      public:
+        explicit DirList(Filesys&);
+        DirList(DirList&&);
+        DirList(const DirList&) = delete;
+        DirList& operator=(const DirList&) = delete;
+        DirList& operator=(DirList&&);
+        ~DirList();
+
+        std::vector<DirEntry>::iterator begin();
+        std::vector<DirEntry>::iterator end();
+        DirEntry& front();
+        size_t size() const;
+        void push_back(const DirEntry&);
+        std::string GetName(const DirEntry&) const;
+
+      private:
+        friend class Filesys;
+        Filesys* owner_;
+        std::vector<DirEntry> entries_;
+        std::string names_;
+    };
+
     class FileEntry
     {
       public:
@@ -84,48 +217,246 @@ class Filesys
         uint32_t size;
         uint32_t clus;
         uint32_t entryLoc;
-        uint32_t openInfo;
+        uint32_t lfnLoc;
+        std::string longName;
+        bool extentsValid;
+        std::vector<Extent> extents;
+        std::vector<uint32_t> extentOrder;
+        uint32_t tail;
+        uint32_t clusCount;
 
-        FileEntry(char*, uint8_t, uint16_t, uint16_t, uint32_t, uint32_t);
+        explicit FileEntry(const DirEntry&, const std::string& = "");
 
         FileEntry(const FileEntry&);
         std::string GetShortName();
+        std::string GetName();
+        bool HasName(const std::string&);
         void SetClus(uint32_t);
         bool IsDir();
         void SetCurrentTime();
+        bool ChainContains(uint32_t);
+        std::vector<Extent>::iterator FindExtent(uint32_t);
+        void AppendRun(uint32_t, uint32_t);
+    };
+
+    // File open in one session or more. Every session sees this one copy
+    // of its size, chain and extent index. Readers sharing the tree lock 
+    // hold lock while they use or build the index
+    struct OpenFile
+    {
+        FileEntry file;
+        std::mutex lock;
+        uint32_t users;
+
+        OpenFile(const DirEntry&, const std::string&);
+    };
+
+    // Handle of a session on an open file, with the mode it was opened in
+    // and its own read-ahead state
+    struct Handle
+    {
+        OpenFile* open;
+        uint32_t openInfo;
+        uint32_t raNext;
+        uint32_t raWindow;
+    };
+
+  public:
+    // Working directory, open files and output of one client. A session
+    // is used by one thread at a time, different sessions may be used
+    // from different threads at once. Calls without a session use the
+    // first, which belongs to the shell and prints to std::cout
+    struct Session
+    {
+        uint32_t cwd;
+        std::string location;
+        // Open files by handle. openByLoc maps the location of the 
+        // directory record of an open file to its handle
+        std::unordered_map<uint32_t, Handle> openFiles;
+        std::unordered_map<uint32_t, uint32_t> openByLoc;
+        uint32_t nextHandle;
+        // Where the commands of the session print
+        std::ostream& out;
+        // Set when the last command of the session failed
+        bool failed;
+
+        explicit Session(std::ostream& = std::cout);
+    };
+
+  private:
+    // Makes a session current on the calling thread and holds the tree 
+    // lock, shared or not, for as long as it is in scope
+    class Scope
+    {
+      public:
+        Scope(Filesys&, Session*, bool);
+        ~Scope();
+        void Pause(double);
+
+      private:
+        Filesys& fs_;
+        Session* caller_;
+        Scope* outer_;
+        bool shared_;
+    };
+
+    // Name index of one directory, keyed by short name. Long names map,
+    // folded to lower case, to the short name of their entry, and are kept
+    // in names
+    struct DirCache
+    {
+        std::vector<uint32_t> chain;
+        std::string names;
+        std::unordered_map<std::string, DirEntry> byName;
+        std::unordered_map<uint32_t, std::string> byLoc;
+        std::unordered_map<std::string, std::string> byLong;
     };
 
-    uint32_t cwd_;
-    std::string location_;
     struct Fat32Info finfo_;
-    std::list<FileEntry> openTable_;
+    struct FatCache fat_;
+    // Commands that only read the image share the tree lock, every other
+    // command holds it alone. The caches filled on the way by readers
+    // have their own locks
+    RwLock treeLock_;
+    std::set<std::string> readers_;
+    std::list<Session> sessions_;
+    // Files open in any session, indexed by the location of their 
+    // directory record. openLock_ is held by open, which only shares the
+    // tree lock
+    std::list<OpenFile> openFiles_;
+    std::unordered_map<uint32_t, std::list<OpenFile>::iterator> openIndex_;
+    std::mutex openLock_;
+    static thread_local Session* session_;
+    static thread_local Scope* scope_;
+    static thread_local std::vector<std::pair<std::vector<DirEntry>, 
+                                              std::string>> dirArena_;
+    std::mutex cacheLock_;
+    std::unordered_map<uint32_t, DirCache> dirCache_;
+    std::unordered_map<uint32_t, uint32_t> dirOfClus_;
+    std::mutex pathLock_;
+    std::list<std::pair<std::string, uint32_t>> pathLru_;
+    std::unordered_map<std::string, 
+         std::list<std::pair<std::string, uint32_t>>::iterator> pathIndex_;
+    // Parent cluster and display name of each directory NavToDir has
+    // entered, which lets GenPathName climb straight to the root
+    std::unordered_map<uint32_t, 
+                       std::pair<uint32_t, std::string>> parentOf_;
+    std::once_flag poolOnce_;
+    WorkPool* pool_;
+    // Directory records written since the last flush, by image offset
+    std::map<size_t, std::array<uint8_t, 32>> pendingRecords_;
+    // Set while a change that must go out in one batch is being made
+    bool holdFlush_;
+    std::string stateDir_;
+    std::string journalName_;
+    // Where defrag remembers how far it got, so a later run resumes
+    std::string defragName_;
+    // Held by export, the engine runs one transfer at a time
+    std::mutex ioLock_;
+    IoEngine* io_;
+    Metrics stats_;
 
+    uint32_t FreeChains(const std::vector<uint32_t>&);
     void UpdateClusCount(std::function 
                       <uint32_t (uint32_t)> op);
+    bool HasFsInfo();
+    void MarkFatDirty(uint32_t, uint32_t);
+    void FlushIfFull();
+    void ReadRecord(uint8_t*, size_t);
+    void DropRecords(size_t, size_t);
+    void Flush();
+    void CheckJournal();
+    void ReplayJournal();
     uint32_t GetFATNxtFree();
-    void SetFATNxtFree(uint32_t);
     uint32_t GetNFreeClus();
-    void SetNFreeClus(uint32_t);
     template <typename T>
     void WriteValue(T*, size_t, size_t, size_t);
     template <typename T>
     void ReadValue(T*, size_t, size_t, size_t);
+    void ReadBytes(void*, size_t, size_t);
+    void WriteBytes(const void*, size_t, size_t);
+    void FillBytes(uint8_t, size_t, size_t);
+    bool VisitSpan(const Span&, 
+                   std::function<bool (const uint8_t*, size_t)>);
+    void LoadFatCache();
     uint32_t GetNextClus(uint32_t);
     void SetNextClus(uint32_t, uint32_t);
+    void LinkRun(uint32_t, uint32_t, uint32_t);
     uint32_t AllocateCluster(uint32_t = 0);
-    void ZeroOutCluster(uint32_t);
-    std::string ValidateFileName(std::string);
-    std::list<FileEntry>* GetFileList(uint32_t, 
-                                      bool = false);
-    std::list<std::string> ParseAddress(std::string);
+    uint32_t AllocateClusters(uint32_t, uint32_t = 0, uint64_t = 0, 
+                              uint64_t = 0, FileEntry* = NULL);
+    bool ValidateFileName(std::string, std::string&);
+    std::string MakeAlias(uint32_t, const std::string&);
+    std::string EntryName(const std::string&);
+    bool MakeEntryName(uint32_t, const std::string&, std::string&, 
+                       std::string&);
+    void SeedLongName(uint32_t, LfnState&);
+    void ReadClusEntries(uint32_t, bool, std::vector<DirEntry>&, 
+                         std::string&, uint32_t = 0);
+    DirList GetFileList(uint32_t, bool = false);
+
+    // Called by WalkTree with the worker index, the path of the entry and
+    // the entry itself
+    typedef std::function<void (size_t, const std::string&, 
+                                DirEntry&)> WalkVisitor;
+    WorkPool& GetPool();
+    bool WalkTree(uint32_t, std::string, WalkVisitor);
+    bool GetTreeRoot(std::vector<std::string>&, size_t, uint32_t&,
+                     std::string&);
+    bool FileCrc(DirEntry&, uint32_t&);
+    uint32_t GetClusLimit();
+    void CheckFatCopies(std::vector<std::vector<std::string>>&);
+    void CheckChains(std::vector<std::atomic<uint64_t>>&,
+                     std::vector<std::vector<std::string>>&,
+                     std::vector<std::vector<std::string>>&,
+                     std::vector<std::vector<std::string>>&);
+    uint32_t GetClusOfLoc(uint32_t);
+    DirCache& GetDirCache(uint32_t);
+    DirEntry* FindEntry(uint32_t, std::string, const std::string** = NULL);
+    void InvalidateDir(uint32_t);
+    void UpdateDirCache(FileEntry&);
+    bool LookupPath(const std::string&, uint32_t&);
+    void CachePath(const std::string&, uint32_t);
+    void InvalidatePaths();
+    std::list<std::string> ParseAddress(std::string, bool = false);
     uint32_t NavToDir(std::list<std::string>&, size_t,
                       size_t);
+    bool FindParent(uint32_t, std::pair<uint32_t, std::string>&);
     std::string GenPathName(uint32_t);
+    void BuildExtents(FileEntry&);
+    uint32_t NextRecordLoc(uint32_t);
+    void SaveLongName(FileEntry&);
     void SaveFileEntry(FileEntry&);
-    FileEntry* AddEntry(uint32_t, std::string, uint8_t);
+    FileEntry* AddEntry(uint32_t, std::string, uint8_t, std::string = "");
+    uint32_t MakeDir(uint32_t, std::string);
+    FileEntry* MakeFile(uint32_t, std::string);
+    Session& Current();
+    std::ostream& Out();
+    std::ostream& Fail();
+    uint32_t OpenHandle(DirEntry&, const std::string&, uint32_t);
+    Handle* GetHandle(uint32_t);
+    uint32_t FindHandle(uint32_t, const std::string&);
+    void ReleaseFile(OpenFile&);
+    void CloseHandle(uint32_t);
+    void CloseEverywhere(uint32_t);
+    IoEngine& GetIo();
+    bool TransferSpans(std::vector<Span>&, int, bool);
+    bool ImportFile(std::string, uint32_t, std::string);
+    void ImportTree(std::string, uint32_t);
+    bool ExportFile(DirEntry&, std::string);
+    void ExportTree(uint32_t, std::string);
+    void ReadAhead(Handle&, uint32_t, uint32_t);
+    bool MapFileRange(FileEntry&, uint32_t, uint32_t, std::vector<Span>&);
     uint32_t FileOperate(char*, uint32_t, uint32_t, FileEntry&, 
-         std::function<void (Filesys&, char*, size_t, 
-         size_t, size_t)> funct);
+                         uint32_t);
+    uint32_t ClaimFreeChain(uint32_t, uint32_t);
+    void ListDeleted(uint32_t, std::vector<DirEntry>&);
+    uint32_t RecoverEntries(uint32_t, std::vector<DirEntry>&);
+    uint32_t CountRuns(uint32_t, uint32_t&);
+    void CopyClusters(uint32_t, uint32_t, uint32_t);
+    void PatchRecordClus(uint32_t, uint32_t);
+    void MoveChain(DirEntry, uint32_t, uint32_t);
+    void SaveDefragCursor(const std::string&, const std::string&);
 
     void Fsinfo(std::vector<std::string>&);
     void Ls(std::vector<std::string>&);
@@ -140,6 +471,17 @@ class Filesys
     void Rmdir(std::vector<std::string>&);
     void Write(std::vector<std::string>&);
     void Undelete(std::vector<std::string>&);
+    void Import(std::vector<std::string>&);
+    void Export(std::vector<std::string>&);
+    void Lsr(std::vector<std::string>&);
+    void Du(std::vector<std::string>&);
+    void Find(std::vector<std::string>&);
+    void Cksum(std::vector<std::string>&);
+    void Check(std::vector<std::string>&);
+    void Frag(std::vector<std::string>&);
+    void Defrag(std::vector<std::string>&);
+    void Sync(std::vector<std::string>&);
+    void Stats(std::vector<std::string>&);
     void Help(std::vector<std::string>&);
 };
 #endif
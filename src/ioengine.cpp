@@ -0,0 +1,288 @@
+#include <ioengine.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+IoEngine::IoEngine(unsigned depth) : ring_(-1), 
+                                     depth_(depth == 0 ? 1 : depth),
+                                     slots_(), 
+                                     free_(),
+                                     unsubmitted_(0),
+                                     sqRing_(MAP_FAILED),
+                                     sqRingLen_(0),
+                                     cqRing_(MAP_FAILED),
+                                     cqRingLen_(0),
+                                     sqes_(NULL),
+                                     sqesLen_(0),
+                                     sqHead_(NULL),
+                                     sqTail_(NULL),
+                                     sqMask_(NULL),
+                                     sqArray_(NULL),
+                                     cqHead_(NULL),
+                                     cqTail_(NULL),
+                                     cqMask_(NULL),
+                                     cqes_(NULL)
+{
+  if (!Setup(depth_))
+  {
+    if (ring_ >= 0)
+      close(ring_);
+    ring_ = -1;
+    depth_ = 1;
+  }
+
+  slots_.resize(depth_);
+  for (unsigned i = depth_; i > 0; --i)
+    free_.push_back(i - 1);
+}
+
+IoEngine::~IoEngine()
+{
+  Wait();
+
+  if (sqes_ != NULL)
+    munmap(sqes_, sqesLen_);
+  if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_)
+    munmap(cqRing_, cqRingLen_);
+  if (sqRing_ != MAP_FAILED)
+    munmap(sqRing_, sqRingLen_);
+  if (ring_ >= 0)
+    close(ring_);
+}
+
+// Creates the ring and maps its queues, returns false if the kernel does
+// not allow io_uring
+bool IoEngine::Setup(unsigned depth)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  ring_ = syscall(__NR_io_uring_setup, depth, &params);
+  if (ring_ < 0)
+    return false;
+
+  depth_ = params.sq_entries;
+  sqRingLen_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingLen_ = params.cq_off.cqes + 
+               params.cq_entries * sizeof(struct io_uring_cqe);
+
+  // Newer kernels share one mapping between both rings
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (cqRingLen_ > sqRingLen_)
+      sqRingLen_ = cqRingLen_;
+    cqRingLen_ = sqRingLen_;
+  }
+
+  sqRing_ = mmap(0, sqRingLen_, PROT_READ | PROT_WRITE, 
+                 MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQ_RING);
+  if (sqRing_ == MAP_FAILED)
+    return false;
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    cqRing_ = sqRing_;
+  else
+    cqRing_ = mmap(0, cqRingLen_, PROT_READ | PROT_WRITE, 
+                   MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_CQ_RING);
+  if (cqRing_ == MAP_FAILED)
+    return false;
+
+  sqesLen_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(0, sqesLen_, PROT_READ | PROT_WRITE, 
+                    MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    return false;
+  sqes_ = (struct io_uring_sqe*)sqes;
+
+  uint8_t* sq = (uint8_t*)sqRing_;
+  uint8_t* cq = (uint8_t*)cqRing_;
+
+  sqHead_ = (unsigned*)(sq + params.sq_off.head);
+  sqTail_ = (unsigned*)(sq + params.sq_off.tail);
+  sqMask_ = (unsigned*)(sq + params.sq_off.ring_mask);
+  sqArray_ = (unsigned*)(sq + params.sq_off.array);
+  cqHead_ = (unsigned*)(cq + params.cq_off.head);
+  cqTail_ = (unsigned*)(cq + params.cq_off.tail);
+  cqMask_ = (unsigned*)(cq + params.cq_off.ring_mask);
+  cqes_ = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  return true;
+}
+
+bool IoEngine::IsAsync()
+{
+  return ring_ >= 0;
+}
+
+unsigned IoEngine::Depth()
+{
+  return depth_;
+}
+
+void IoEngine::Read(int fd, void* buf, size_t len, uint64_t off, Done done)
+{
+  Request request = { fd, (uint8_t*)buf, len, off, 0, false, done, 
+                      iovec() };
+  Queue(request);
+}
+
+void IoEngine::Write(int fd, const void* buf, size_t len, uint64_t off, 
+                     Done done)
+{
+  Request request = { fd, (uint8_t*)buf, len, off, 0, true, done, 
+                      iovec() };
+  Queue(request);
+}
+
+// Runs request to the end with pread or pwrite
+void IoEngine::RunSync(Request& request)
+{
+  while (request.done < request.len)
+  {
+    ssize_t moved = request.write ? 
+        pwrite(request.fd, request.buf + request.done, 
+               request.len - request.done, request.off + request.done) :
+        pread(request.fd, request.buf + request.done, 
+              request.len - request.done, request.off + request.done);
+
+    if (moved < 0 && errno == EINTR)
+      continue;
+    if (moved < 0)
+    {
+      request.finish(-errno);
+      return;
+    }
+    if (moved == 0)
+      break;
+    request.done += moved;
+  }
+  request.finish(request.done);
+}
+
+// Takes a slot for request, waiting for one to free up if need be
+void IoEngine::Queue(Request request)
+{
+  if (ring_ < 0)
+  {
+    RunSync(request);
+    return;
+  }
+
+  while (free_.empty())
+    WaitOne();
+
+  unsigned slot = free_.back();
+  free_.pop_back();
+  slots_[slot] = request;
+  Push(slot);
+}
+
+// Fills in the next submission entry for the rest of slot
+void IoEngine::Push(unsigned slot)
+{
+  Request& request = slots_[slot];
+  unsigned tail = *sqTail_;
+  unsigned index = tail & *sqMask_;
+  struct io_uring_sqe* sqe = &sqes_[index];
+
+  request.iov.iov_base = request.buf + request.done;
+  request.iov.iov_len = request.len - request.done;
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = request.write ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd = request.fd;
+  sqe->addr = (uint64_t)(uintptr_t)&request.iov;
+  sqe->len = 1;
+  sqe->off = request.off + request.done;
+  sqe->user_data = slot;
+
+  sqArray_[index] = index;
+  __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+  ++unsubmitted_;
+}
+
+// Hands the queued entries to the kernel, waiting for wait completions
+void IoEngine::Submit(unsigned wait)
+{
+  unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+  while (1)
+  {
+    int entered = syscall(__NR_io_uring_enter, ring_, unsubmitted_, wait, 
+                          flags, NULL, 0);
+    if (entered < 0 && (errno == EINTR || errno == EAGAIN))
+      continue;
+    if (entered > 0)
+      unsubmitted_ -= entered;
+    return;
+  }
+}
+
+// Handles every completion waiting in the ring, returns false if there
+// were none
+bool IoEngine::Reap()
+{
+  unsigned head;
+  bool any = false;
+
+  // The head is read again for every completion, since a finish that 
+  // waits for more reaps some of them itself
+  while ((head = *cqHead_) != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE))
+  {
+    struct io_uring_cqe* cqe = &cqes_[head & *cqMask_];
+    unsigned slot = cqe->user_data;
+    int result = cqe->res;
+
+    any = true;
+    __atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+
+    Request& request = slots_[slot];
+
+    if (result == -EINTR || result == -EAGAIN)
+    {
+      Push(slot);
+      continue;
+    }
+
+    if (result > 0)
+    {
+      request.done += result;
+      if (request.done < request.len)
+      {
+        Push(slot);
+        continue;
+      }
+    }
+
+    // The slot is given back first so that finish can queue more
+    Done finish = request.finish;
+    ssize_t moved = result < 0 ? result : (ssize_t)request.done;
+    request.finish = Done();
+    free_.push_back(slot);
+    finish(moved);
+  }
+  return any;
+}
+
+bool IoEngine::WaitOne()
+{
+  if (ring_ < 0 || free_.size() == depth_)
+    return false;
+
+  Submit(0);
+  while (!Reap())
+    Submit(1);
+
+  if (unsubmitted_ > 0)
+    Submit(0);
+  return true;
+}
+
+void IoEngine::Wait()
+{
+  while (WaitOne())
+    ;
+}
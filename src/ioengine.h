@@ -0,0 +1,81 @@
+#ifndef _IOENGINE_H
+#define _IOENGINE_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// Moves data between file descriptors and memory with up to depth
+// requests in flight through io_uring. Falls back to doing each request
+// on the spot with pread and pwrite when the kernel has no io_uring.
+// Short transfers are resubmitted until done, end of file or an error.
+// Completions are handled on the thread calling into the engine, and may
+// queue further requests
+class IoEngine
+{
+  public:
+    // Called with the bytes moved, or a negated errno
+    typedef std::function<void (ssize_t)> Done;
+
+    IoEngine(unsigned = 64);
+    ~IoEngine();
+
+    bool IsAsync();
+    unsigned Depth();
+    void Read(int, void*, size_t, uint64_t, Done);
+    void Write(int, const void*, size_t, uint64_t, Done);
+    // Waits for at least one request to finish, returns false if there
+    // were none in flight
+    bool WaitOne();
+    void Wait();
+
+  private:
+    struct Request
+    {
+        int fd;
+        uint8_t* buf;
+        size_t len;
+        uint64_t off;
+        size_t done;
+        bool write;
+        Done finish;
+        // What is left of the transfer, readv and writev work on every
+        // kernel with io_uring where plain read and write need 5.6
+        struct iovec iov;
+    };
+
+    int ring_;
+    unsigned depth_;
+    std::vector<Request> slots_;
+    std::vector<unsigned> free_;
+    unsigned unsubmitted_;
+
+    void* sqRing_;
+    size_t sqRingLen_;
+    void* cqRing_;
+    size_t cqRingLen_;
+    io_uring_sqe* sqes_;
+    size_t sqesLen_;
+    unsigned* sqHead_;
+    unsigned* sqTail_;
+    unsigned* sqMask_;
+    unsigned* sqArray_;
+    unsigned* cqHead_;
+    unsigned* cqTail_;
+    unsigned* cqMask_;
+    io_uring_cqe* cqes_;
+
+    bool Setup(unsigned);
+    void Queue(Request);
+    void Push(unsigned);
+    void Submit(unsigned);
+    bool Reap();
+    void RunSync(Request&);
+};
+#endif
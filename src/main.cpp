@@ -1,111 +1,203 @@
 #include <filesys.h>
 #include <iostream>
+#include <fstream>
 #include <string>
 #include <sstream>
+#include <cstring>
 
-int main (int argc, char* argv[])
+// Splits a command line into the command name and its arguments, double
+// quotes group words. Returns false if a quote is left open
+static bool Tokenize(const std::string& input, std::string& name,
+                     std::vector<std::string>& argv)
 {
-  if (argc == 2)
-  {
-    std::string filename = argv[1];
-    Filesys file(filename);
+  int c = -1;
+  bool newWord = false;
+  bool lookForEndQuote = false;
 
-    if (file.HasError())
+  for (size_t i = 0; i < input.length(); ++i)
+  {
+    if (((input[i] == ' ' || input[i] == '\t') && !lookForEndQuote) ||
+        (lookForEndQuote && input[i] == '"') ||
+        (newWord && input[i] == '"' && !lookForEndQuote))
     {
-      std::cout << "Error: Unrecognized file name" << std::endl;
-      return 1;
+      if (!newWord)
+      {
+        newWord = true;
+        ++c;
+      }
+
+      if (lookForEndQuote && input[i] == '"')
+        lookForEndQuote = false;
+      else if (input[i] == '"')
+        lookForEndQuote = true;
+
+      continue;
     }
 
-    try
+    if (c == -1)
     {
-      file.Validate();
+      name.push_back(input[i]);
     }
-    catch (std::exception &e)
+    else
+    {
+      if (newWord)
+      {
+        newWord = false;
+        argv.push_back("");
+      }
+
+      argv.back().push_back(input[i]);
+    }
+  }
+
+  return !lookForEndQuote;
+}
+
+static void Usage(char* prog)
+{
+  std::cout << "Usage: " << prog 
+            << " [-b] [-s] [-j <directory>] [-m | -p | -d] <file system>"
+            << " [script]" << std::endl
+            << "  -b  batch mode, read commands without prompting"
+            << std::endl
+            << "  -s  report the status of each command on stderr"
+            << std::endl
+            << "  -j  keep the journal and defrag cursor in directory"
+            << std::endl
+            << "  -m  map the whole image into memory" << std::endl
+            << "  -p  use pread and pwrite through a block cache" 
+            << std::endl
+            << "  -d  as -p, with O_DIRECT" << std::endl;
+}
+
+int main (int argc, char* argv[])
+{
+  bool batch = false;
+  bool status = false;
+  Storage::Kind kind = Storage::AUTO;
+  std::string stateDir;
+  int arg = 1;
+
+  for (; arg < argc && argv[arg][0] == '-'; ++arg)
+  {
+    if (strcmp(argv[arg], "-b") == 0)
+      batch = true;
+    else if (strcmp(argv[arg], "-s") == 0)
+      status = true;
+    else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc)
+      stateDir = argv[++arg];
+    else if (strcmp(argv[arg], "-m") == 0)
+      kind = Storage::MAP;
+    else if (strcmp(argv[arg], "-p") == 0)
+      kind = Storage::BLOCK;
+    else if (strcmp(argv[arg], "-d") == 0)
+      kind = Storage::DIRECT;
+    else
     {
-      std::cout << "Invalid image" << std::endl;
+      Usage(argv[0]);
       return 1;
     }
+  }
+
+  if (argc - arg != 1 && argc - arg != 2)
+  {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  std::string filename = argv[arg];
+  std::ifstream script;
 
-    try
+  // A script file is always run in batch mode
+  if (argc - arg == 2)
+  {
+    script.open(argv[arg + 1]);
+    if (!script)
     {
-      while (1)
-      {
-        std::string input;
+      std::cout << "Error: Unable to open script" << std::endl;
+      return 1;
+    }
+    batch = true;
+  }
 
-        std::cout << "Enter command or exit : " << file.GetLocation() << " > ";
-        std::getline(std::cin, input);
+  std::istream& in = script.is_open() ? script : std::cin;
 
-        if (input == "exit")
-          break;
+  // Nothing is interleaved with C stdio, so let iostreams buffer freely
+  // instead of syncing on every write
+  if (batch)
+    std::ios::sync_with_stdio(false);
 
-        std::vector<std::string> argv;
-        std::string name;
-        std::string temp;
-        int c = -1;
-        bool newWord = false;
-        bool lookForEndQuote = false;
+  Filesys file(filename, kind, stateDir);
 
-        for (size_t i = 0; i < input.length(); ++i)
-        {
-          if (((input[i] == ' ' || input[i] == '\t') && !lookForEndQuote) ||
-              (lookForEndQuote && input[i] == '"') ||
-              (newWord && input[i] == '"' && !lookForEndQuote))
-          {
-            if (!newWord)
-            {
-              newWord = true;
-              ++c;
-            }
-
-            if (lookForEndQuote && input[i] == '"')
-              lookForEndQuote = false;
-            else if (input[i] == '"')
-              lookForEndQuote = true;
-
-            continue;
-          }
-
-          if (c == -1)
-          {
-            name.push_back(input[i]);
-          }
-          else
-          {
-            if (newWord)
-            {
-              newWord = false;
-              argv.push_back("");
-            }
-
-            argv.back().push_back(input[i]);
-          }
-        }
+  if (file.HasError())
+  {
+    std::cout << "Error: Unrecognized file name" << std::endl;
+    return 1;
+  }
 
-        if (!lookForEndQuote)
-        {
-          if (name == "")
-            continue;
+  try
+  {
+    file.Validate();
+  }
+  catch (std::exception &e)
+  {
+    std::cout << "Invalid image" << std::endl;
+    return 1;
+  }
 
-          if (!file.CallFunct(name, argv))
-            std::cout << "Invalid command" << std::endl;
-        }
-        else
+  try
+  {
+    std::string input;
+    size_t line = 0;
+
+    while (1)
+    {
+      if (!batch)
+        std::cout << "Enter command or exit : " << file.GetLocation()
+                  << " > ";
+
+      if (!std::getline(in, input) || input == "exit")
+        break;
+
+      ++line;
+
+      std::vector<std::string> args;
+      std::string name;
+      const char* result = "ok";
+
+      if (Tokenize(input, name, args))
+      {
+        if (name == "")
+          continue;
+
+        if (!file.CallFunct(name, args))
         {
-          std::cout << "Error: Unclosed Quote" << std::endl;
+          std::cout << "Invalid command" << '\n';
+          result = "invalid_command";
         }
+        else if (file.Failed())
+          result = "failed";
+      }
+      else
+      {
+        std::cout << "Error: Unclosed Quote" << '\n';
+        result = "unclosed_quote";
+      }
+
+      if (status)
+      {
+        std::cout.flush();
+        std::cerr << "status\t" << line << '\t' << result << '\t'
+                  << name << '\n';
       }
-    }
-    catch (std::exception &e)
-    {
-      std::cout << "An error occured" << std::endl;
-      return 1;
     }
   }
-  else
+  catch (std::exception &e)
   {
-    std::cout << "Usage: " << argv[0] << " <file system>" << std::endl;
+    std::cout << "An error occured" << std::endl;
     return 1;
   }
 
+  std::cout.flush();
   return 0;
 }
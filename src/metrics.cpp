@@ -0,0 +1,160 @@
+#include <metrics.h>
+#include <iomanip>
+#include <algorithm>
+
+// Names of the counters and timers, in the order of their enums
+static const char* counterNames[] =
+{
+  "commands", "next_clus", "bytes_read", "bytes_written", "fat_scans",
+  "dir_reads", "dir_cache_hits", "dir_cache_misses", "path_cache_hits",
+  "path_cache_misses", "clus_allocated", "clus_freed"
+};
+
+static const char* timerNames[] =
+{
+  "get_file_list", "nav_to_dir", "allocate", "file_operate",
+  "set_next_clus"
+};
+
+Metrics::Timed::Timed(Metrics& metrics, Timer timer) : metrics_(metrics),
+                                                       timer_(timer),
+                              start_(std::chrono::steady_clock::now())
+{
+}
+
+Metrics::Timed::~Timed()
+{
+  metrics_.Record(timer_, std::chrono::duration_cast
+      <std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                 start_).count());
+}
+
+Metrics::Metrics()
+{
+  Reset();
+}
+
+void Metrics::Add(Counter counter, uint64_t n)
+{
+  counters_[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+// Adds one latency in nanoseconds to the histogram of timer
+void Metrics::Record(Timer timer, uint64_t ns)
+{
+  Histogram& h = timers_[timer];
+  size_t bucket = 0;
+
+  while (bucket + 1 < BUCKETS && ns >= ((uint64_t)1 << bucket))
+    ++bucket;
+
+  h.count.fetch_add(1, std::memory_order_relaxed);
+  h.total.fetch_add(ns, std::memory_order_relaxed);
+  h.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+
+  uint64_t seen = h.max.load(std::memory_order_relaxed);
+  while (ns > seen &&
+         !h.max.compare_exchange_weak(seen, ns, std::memory_order_relaxed))
+    ;
+}
+
+// Zeroes everything, updates racing with it may land on either side
+void Metrics::Reset()
+{
+  for (size_t i = 0; i < COUNTERS; ++i)
+    counters_[i].store(0, std::memory_order_relaxed);
+
+  for (size_t t = 0; t < TIMERS; ++t)
+  {
+    timers_[t].count.store(0, std::memory_order_relaxed);
+    timers_[t].total.store(0, std::memory_order_relaxed);
+    timers_[t].max.store(0, std::memory_order_relaxed);
+    for (size_t b = 0; b < BUCKETS; ++b)
+      timers_[t].buckets[b].store(0, std::memory_order_relaxed);
+  }
+}
+
+// Returns the upper bound of the bucket holding fraction p of the
+// latencies, capped by the longest one seen
+uint64_t Metrics::Percentile(const Histogram& h, double p)
+{
+  uint64_t count = h.count.load(std::memory_order_relaxed);
+  uint64_t max = h.max.load(std::memory_order_relaxed);
+  uint64_t rank = (uint64_t)(p * count);
+  uint64_t seen = 0;
+
+  for (size_t b = 0; b + 1 < BUCKETS; ++b)
+  {
+    seen += h.buckets[b].load(std::memory_order_relaxed);
+    if (seen > rank)
+      return std::min<uint64_t>(max, ((uint64_t)1 << b) - 1);
+  }
+  return max;
+}
+
+// Prints the counters, then one line per timer with its latencies in
+// microseconds
+void Metrics::Print(std::ostream& out)
+{
+  std::ios::fmtflags flags = out.flags();
+  std::streamsize precision = out.precision();
+
+  for (size_t i = 0; i < COUNTERS; ++i)
+  {
+    out << "  " << std::left << std::setw(20) << counterNames[i]
+        << std::right << counters_[i].load(std::memory_order_relaxed)
+        << '\n';
+  }
+
+  out << "  " << std::left << std::setw(16) << "timer" << std::right
+      << std::setw(10) << "count" << std::setw(10) << "mean"
+      << std::setw(10) << "p50" << std::setw(10) << "p90"
+      << std::setw(10) << "p99" << std::setw(10) << "max" << '\n';
+
+  for (size_t t = 0; t < TIMERS; ++t)
+  {
+    Histogram& h = timers_[t];
+    uint64_t count = h.count.load(std::memory_order_relaxed);
+    double mean = count == 0 ? 0 :
+                  (double)h.total.load(std::memory_order_relaxed) / count;
+
+    out << "  " << std::left << std::setw(16) << timerNames[t]
+        << std::right << std::setw(10) << count
+        << std::fixed << std::setprecision(1)
+        << std::setw(10) << mean / 1000
+        << std::setw(10) << Percentile(h, 0.50) / 1000.0
+        << std::setw(10) << Percentile(h, 0.90) / 1000.0
+        << std::setw(10) << Percentile(h, 0.99) / 1000.0
+        << std::setw(10) << h.max.load(std::memory_order_relaxed) / 1000.0
+        << '\n';
+  }
+
+  out.flags(flags);
+  out.precision(precision);
+}
+
+// Prints everything as one JSON object, latencies in nanoseconds
+void Metrics::PrintJson(std::ostream& out)
+{
+  out << "{\"counters\":{";
+  for (size_t i = 0; i < COUNTERS; ++i)
+  {
+    out << (i == 0 ? "" : ",") << '"' << counterNames[i] << "\":"
+        << counters_[i].load(std::memory_order_relaxed);
+  }
+
+  out << "},\"timers\":{";
+  for (size_t t = 0; t < TIMERS; ++t)
+  {
+    Histogram& h = timers_[t];
+
+    out << (t == 0 ? "" : ",") << '"' << timerNames[t] << "\":{"
+        << "\"count\":" << h.count.load(std::memory_order_relaxed)
+        << ",\"total_ns\":" << h.total.load(std::memory_order_relaxed)
+        << ",\"p50_ns\":" << Percentile(h, 0.50)
+        << ",\"p90_ns\":" << Percentile(h, 0.90)
+        << ",\"p99_ns\":" << Percentile(h, 0.99)
+        << ",\"max_ns\":" << h.max.load(std::memory_order_relaxed) << '}';
+  }
+  out << "}}" << '\n';
+}
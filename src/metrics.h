@@ -0,0 +1,96 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+// Counts and times the hot paths of Filesys. Building with
+// FILESYS_STATS set to 0 turns every counter and timer into nothing
+#ifndef FILESYS_STATS
+#define FILESYS_STATS 1
+#endif
+
+// Counters and latency histograms, safe to update from several threads
+// at once. Latencies go into buckets by powers of two of nanoseconds, so
+// percentiles are reported as the upper bound of their bucket
+class Metrics
+{
+  public:
+    enum Counter
+    {
+      COMMANDS,
+      NEXT_CLUS,
+      BYTES_READ,
+      BYTES_WRITTEN,
+      FAT_SCANS,
+      DIR_READS,
+      DIR_CACHE_HITS,
+      DIR_CACHE_MISSES,
+      PATH_CACHE_HITS,
+      PATH_CACHE_MISSES,
+      CLUS_ALLOCATED,
+      CLUS_FREED,
+      COUNTERS
+    };
+
+    enum Timer
+    {
+      GET_FILE_LIST,
+      NAV_TO_DIR,
+      ALLOCATE,
+      FILE_OPERATE,
+      SET_NEXT_CLUS,
+      TIMERS
+    };
+
+    // Times its scope into a histogram
+    class Timed
+    {
+      public:
+        Timed(Metrics&, Timer);
+        ~Timed();
+
+      private:
+        Metrics& metrics_;
+        Timer timer_;
+        std::chrono::steady_clock::time_point start_;
+    };
+
+    Metrics();
+    void Add(Counter, uint64_t = 1);
+    void Record(Timer, uint64_t);
+    void Reset();
+    void Print(std::ostream&);
+    void PrintJson(std::ostream&);
+
+  private:
+    // Bucket i holds latencies below 2^i nanoseconds, the last everything
+    // longer
+    static const size_t BUCKETS = 40;
+
+    struct Histogram
+    {
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> total;
+        std::atomic<uint64_t> max;
+        std::atomic<uint64_t> buckets[BUCKETS];
+    };
+
+    std::atomic<uint64_t> counters_[COUNTERS];
+    Histogram timers_[TIMERS];
+
+    uint64_t Percentile(const Histogram&, double);
+};
+
+#if FILESYS_STATS
+#define STAT_ADD(metrics, counter, n) (metrics).Add(Metrics::counter, n)
+#define STAT_TIME(metrics, timer) \
+  Metrics::Timed statTimer_((metrics), Metrics::timer)
+#else
+#define STAT_ADD(metrics, counter, n) ((void)sizeof(n))
+#define STAT_TIME(metrics, timer) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,486 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Builds synthetic FAT32 images for the benchmarks. The tree is fanout
+// directories wide at every level down to depth, each directory holding
+// files of sizes spread evenly on a log scale between the two bounds.
+// Fragmentation is the chance of leaving a hole after each cluster
+
+// Sets mask to take lower 28 bits
+#define FATMASK 0x0FFFFFFF
+// Marks the end of a chain
+#define FATEOC 0x0FFFFFFF
+// Sectors before the first FAT
+#define RSVD_SECTORS 32
+// Largest hole left by fragmentation, in clusters
+#define MAX_HOLE 64
+
+struct Options
+{
+    uint64_t sizeMb;
+    uint32_t bytesPerSec;
+    uint32_t secPerClus;
+    uint32_t numFats;
+    uint32_t fanout;
+    uint32_t depth;
+    uint32_t files;
+    uint32_t minSize;
+    uint32_t maxSize;
+    uint32_t frag;
+    uint64_t seed;
+};
+
+// Directory record as laid out on disk
+struct Record
+{
+    char name[11];
+    uint8_t attr;
+    uint32_t clus;
+    uint32_t size;
+};
+
+class ImageBuilder
+{
+  public:
+    ImageBuilder(const Options&, int);
+    bool Build();
+
+  private:
+    Options opt_;
+    int fd_;
+    uint32_t fatSz_;
+    uint32_t firstDataSec_;
+    uint32_t nClusters_;
+    uint32_t clusBytes_;
+    uint32_t cursor_;
+    uint32_t nFree_;
+    uint32_t nDirs_;
+    uint32_t nFiles_;
+    uint32_t nFragments_;
+    uint64_t rng_;
+    bool full_;
+    std::vector<uint32_t> fat_;
+
+    uint64_t Random();
+    uint32_t Allocate(uint32_t);
+    uint32_t DirClusters(uint32_t);
+    void BuildDir(uint32_t, uint32_t, uint32_t);
+    void WriteRecords(uint32_t, std::vector<Record>&);
+    void FillFile(uint32_t, uint32_t, uint32_t);
+    void WriteAt(const void*, size_t, uint64_t);
+    void WriteHeader();
+};
+
+static void Store16(uint8_t* dst, uint16_t value)
+{
+  dst[0] = value & 0xFF;
+  dst[1] = value >> 8;
+}
+
+static void Store32(uint8_t* dst, uint32_t value)
+{
+  for (int i = 0; i < 4; ++i)
+    dst[i] = (value >> (8 * i)) & 0xFF;
+}
+
+// Pads name and extension out to an 8.3 record name
+static void MakeName(char* out, const char* name, const char* ext)
+{
+  memset(out, ' ', 11);
+  memcpy(out, name, std::min<size_t>(strlen(name), 8));
+  memcpy(out + 8, ext, std::min<size_t>(strlen(ext), 3));
+}
+
+ImageBuilder::ImageBuilder(const Options& opt, int fd) : opt_(opt),
+                                                        fd_(fd),
+                                                        fatSz_(0),
+                                                        firstDataSec_(0),
+                                                        nClusters_(0),
+                                                        clusBytes_(0),
+                                                        cursor_(2),
+                                                        nFree_(0),
+                                                        nDirs_(0),
+                                                        nFiles_(0),
+                                                        nFragments_(0),
+                                                        rng_(opt.seed | 1),
+                                                        full_(false),
+                                                        fat_()
+{
+  uint64_t totSec = opt_.sizeMb * 1024 * 1024 / opt_.bytesPerSec;
+
+  clusBytes_ = opt_.bytesPerSec * opt_.secPerClus;
+  fatSz_ = ((totSec / opt_.secPerClus + 2) * 4 + opt_.bytesPerSec - 1) /
+           opt_.bytesPerSec;
+  firstDataSec_ = RSVD_SECTORS + opt_.numFats * fatSz_;
+  nClusters_ = (totSec - firstDataSec_) / opt_.secPerClus;
+  nFree_ = nClusters_;
+
+  fat_.assign(fatSz_ * opt_.bytesPerSec / 4, 0);
+  fat_[0] = 0x0FFFFFF8;
+  fat_[1] = FATEOC;
+}
+
+// xorshift64, deterministic for a given seed
+uint64_t ImageBuilder::Random()
+{
+  rng_ ^= rng_ << 13;
+  rng_ ^= rng_ >> 7;
+  rng_ ^= rng_ << 17;
+  return rng_;
+}
+
+// Chains count free clusters together going on from the cursor, leaving
+// a hole after a cluster as often as fragmentation asks for. Returns the
+// first cluster, or 0 once the image is full
+uint32_t ImageBuilder::Allocate(uint32_t count)
+{
+  if (count > nFree_ || count == 0)
+  {
+    full_ = true;
+    return 0;
+  }
+
+  uint32_t first = 0;
+  uint32_t last = 0;
+
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    while (fat_[cursor_] != 0)
+    {
+      if (++cursor_ >= nClusters_ + 2)
+        cursor_ = 2;
+    }
+
+    if (first == 0)
+      first = cursor_;
+    else
+    {
+      if (cursor_ != last + 1)
+        ++nFragments_;
+      fat_[last] = cursor_;
+    }
+
+    fat_[cursor_] = FATEOC;
+    last = cursor_;
+    --nFree_;
+
+    if (opt_.frag > 0 && Random() % 100 < opt_.frag)
+      cursor_ += 1 + Random() % MAX_HOLE;
+    else
+      ++cursor_;
+
+    if (cursor_ >= nClusters_ + 2)
+      cursor_ = 2;
+  }
+  return first;
+}
+
+// Clusters needed for a directory of n records
+uint32_t ImageBuilder::DirClusters(uint32_t n)
+{
+  return std::max<uint32_t>(1, (n * 32 + clusBytes_ - 1) / clusBytes_);
+}
+
+void ImageBuilder::WriteAt(const void* data, size_t len, uint64_t pos)
+{
+  const uint8_t* bytes = (const uint8_t*)data;
+  size_t done = 0;
+
+  while (done < len)
+  {
+    ssize_t put = pwrite(fd_, bytes + done, len - done, pos + done);
+    if (put <= 0)
+    {
+      perror("pwrite");
+      exit(1);
+    }
+    done += put;
+  }
+}
+
+// Writes records into the directory chain starting at cluster. The image
+// starts out zeroed, so the rest of the chain is already free records
+void ImageBuilder::WriteRecords(uint32_t cluster,
+                                std::vector<Record>& records)
+{
+  std::vector<uint8_t> data(DirClusters(records.size()) * clusBytes_, 0);
+
+  for (size_t i = 0; i < records.size(); ++i)
+  {
+    uint8_t* r = &data[i * 32];
+    memcpy(r, records[i].name, 11);
+    r[11] = records[i].attr;
+    Store16(r + 20, records[i].clus >> 16);
+    // Written 2020-01-01 12:00
+    Store16(r + 22, 12 << 11);
+    Store16(r + 24, (40 << 9) | (1 << 5) | 1);
+    Store16(r + 26, records[i].clus & 0xFFFF);
+    Store32(r + 28, records[i].size);
+  }
+
+  for (size_t off = 0; off < data.size(); off += clusBytes_)
+  {
+    WriteAt(&data[off], clusBytes_,
+            ((uint64_t)(cluster - 2) * opt_.secPerClus + firstDataSec_) *
+            opt_.bytesPerSec);
+    cluster = fat_[cluster] & FATMASK;
+  }
+}
+
+// Fills the chain of a file with a pattern made from its number, one write
+// per run of contiguous clusters
+void ImageBuilder::FillFile(uint32_t cluster, uint32_t size, uint32_t id)
+{
+  std::vector<uint8_t> run;
+
+  while (size > 0 && cluster < 0x0FFFFFF8)
+  {
+    uint32_t start = cluster;
+    uint32_t length = 0;
+
+    do
+    {
+      ++length;
+      cluster = fat_[cluster] & FATMASK;
+    } while (cluster == start + length &&
+             (uint64_t)length * clusBytes_ < size);
+
+    size_t bytes = std::min<uint64_t>((uint64_t)length * clusBytes_, size);
+    run.resize(bytes);
+    for (size_t i = 0; i < bytes; ++i)
+      run[i] = (uint8_t)(id * 31 + i);
+
+    WriteAt(run.data(), bytes,
+            ((uint64_t)(start - 2) * opt_.secPerClus + firstDataSec_) *
+            opt_.bytesPerSec);
+    size -= bytes;
+  }
+}
+
+// Fills the directory at self, a child of parent, and everything below.
+// Its chain has room for all of its records already
+void ImageBuilder::BuildDir(uint32_t self, uint32_t parent, uint32_t depth)
+{
+  std::vector<Record> records;
+  Record record;
+
+  if (self != 2)
+  {
+    MakeName(record.name, ".", "");
+    record.attr = 0x10;
+    record.clus = self;
+    record.size = 0;
+    records.push_back(record);
+
+    MakeName(record.name, "..", "");
+    record.clus = parent == 2 ? 0 : parent;
+    records.push_back(record);
+  }
+
+  uint32_t subdirs = depth > 0 ? opt_.fanout : 0;
+  uint32_t childRecords = 2 + (depth > 1 ? opt_.fanout : 0) + opt_.files;
+  std::vector<uint32_t> children;
+
+  for (uint32_t i = 0; i < subdirs && !full_; ++i)
+  {
+    uint32_t clus = Allocate(DirClusters(childRecords));
+    if (clus == 0)
+      break;
+
+    char name[9];
+    snprintf(name, sizeof(name), "D%07u", nDirs_++);
+    MakeName(record.name, name, "");
+    record.attr = 0x10;
+    record.clus = clus;
+    record.size = 0;
+    records.push_back(record);
+    children.push_back(clus);
+  }
+
+  for (uint32_t i = 0; i < opt_.files && !full_; ++i)
+  {
+    // Spread evenly on a log scale between the bounds
+    double t = (double)(Random() % 1000000) / 1000000;
+    uint32_t size = opt_.minSize *
+                    pow((double)opt_.maxSize / opt_.minSize, t);
+    uint32_t clus = size == 0 ? 0 :
+                    Allocate((size + clusBytes_ - 1) / clusBytes_);
+
+    if (size != 0 && clus == 0)
+      break;
+
+    char name[9];
+    snprintf(name, sizeof(name), "F%07u", nFiles_);
+    MakeName(record.name, name, "DAT");
+    record.attr = 0x20;
+    record.clus = clus;
+    record.size = size;
+    records.push_back(record);
+
+    FillFile(clus, size, nFiles_++);
+  }
+
+  WriteRecords(self, records);
+
+  for (uint32_t child : children)
+    BuildDir(child, self, depth - 1);
+}
+
+// Writes the boot sector, FSInfo and every FAT copy
+void ImageBuilder::WriteHeader()
+{
+  uint8_t boot[512];
+  uint8_t info[512];
+  uint64_t totSec = opt_.sizeMb * 1024 * 1024 / opt_.bytesPerSec;
+
+  memset(boot, 0, sizeof(boot));
+  memcpy(boot, "\xEB\x58\x90" "MSWIN4.1", 11);
+  Store16(boot + 11, opt_.bytesPerSec);
+  boot[13] = opt_.secPerClus;
+  Store16(boot + 14, RSVD_SECTORS);
+  boot[16] = opt_.numFats;
+  boot[21] = 0xF8;
+  Store16(boot + 24, 63);
+  Store16(boot + 26, 255);
+  Store32(boot + 32, totSec);
+  Store32(boot + 36, fatSz_);
+  Store32(boot + 44, 2);
+  Store16(boot + 48, 1);
+  Store16(boot + 50, 6);
+  boot[64] = 0x80;
+  boot[66] = 0x29;
+  Store32(boot + 67, (uint32_t)opt_.seed);
+  memcpy(boot + 71, "NO NAME    FAT32   ", 19);
+  boot[510] = 0x55;
+  boot[511] = 0xAA;
+
+  memset(info, 0, sizeof(info));
+  Store32(info, 0x41615252);
+  Store32(info + 484, 0x61417272);
+  Store32(info + 488, nFree_);
+  Store32(info + 492, cursor_);
+  Store32(info + 508, 0xAA550000);
+
+  WriteAt(boot, sizeof(boot), 0);
+  WriteAt(info, sizeof(info), opt_.bytesPerSec);
+  WriteAt(boot, sizeof(boot), 6 * opt_.bytesPerSec);
+
+  std::vector<uint8_t> fat(fat_.size() * 4);
+  for (size_t i = 0; i < fat_.size(); ++i)
+    Store32(&fat[i * 4], fat_[i]);
+
+  for (uint32_t i = 0; i < opt_.numFats; ++i)
+  {
+    WriteAt(fat.data(), fat.size(),
+            ((uint64_t)RSVD_SECTORS + i * fatSz_) * opt_.bytesPerSec);
+  }
+}
+
+bool ImageBuilder::Build()
+{
+  uint64_t bytes = opt_.sizeMb * 1024 * 1024;
+
+  if (ftruncate(fd_, 0) < 0 || ftruncate(fd_, bytes) < 0)
+  {
+    perror("ftruncate");
+    return false;
+  }
+
+  uint32_t rootRecords = (opt_.depth > 0 ? opt_.fanout : 0) + opt_.files;
+  uint32_t root = Allocate(DirClusters(rootRecords));
+
+  if (root != 2)
+  {
+    std::cerr << "Image too small" << '\n';
+    return false;
+  }
+
+  BuildDir(root, 0, opt_.depth);
+  WriteHeader();
+
+  std::cout << nDirs_ << " directories, " << nFiles_ << " files, "
+            << nClusters_ - nFree_ << " of " << nClusters_
+            << " clusters used, " << nFragments_ << " fragments"
+            << (full_ ? ", image full" : "") << '\n';
+  return true;
+}
+
+static void Usage(char* prog)
+{
+  std::cerr << "Usage: " << prog << " [options] <image>" << '\n'
+            << "  -m <mb>        image size in MiB (256)" << '\n'
+            << "  -b <bytes>     bytes per sector (512)" << '\n'
+            << "  -c <sectors>   sectors per cluster (4)" << '\n'
+            << "  -w <dirs>      directories per directory (8)" << '\n'
+            << "  -d <levels>    directory depth (2)" << '\n'
+            << "  -n <files>     files per directory (16)" << '\n'
+            << "  -z <min:max>   file size bounds in bytes (1024:262144)"
+            << '\n'
+            << "  -f <percent>   chance of a hole after a cluster (0)"
+            << '\n'
+            << "  -r <seed>      random seed (1)" << '\n';
+}
+
+int main(int argc, char* argv[])
+{
+  Options opt = { 256, 512, 4, 2, 8, 2, 16, 1024, 262144, 0, 1 };
+  int c;
+
+  while ((c = getopt(argc, argv, "m:b:c:w:d:n:z:f:r:")) != -1)
+  {
+    switch (c)
+    {
+      case 'm': opt.sizeMb = strtoull(optarg, NULL, 10); break;
+      case 'b': opt.bytesPerSec = strtoul(optarg, NULL, 10); break;
+      case 'c': opt.secPerClus = strtoul(optarg, NULL, 10); break;
+      case 'w': opt.fanout = strtoul(optarg, NULL, 10); break;
+      case 'd': opt.depth = strtoul(optarg, NULL, 10); break;
+      case 'n': opt.files = strtoul(optarg, NULL, 10); break;
+      case 'z':
+        if (sscanf(optarg, "%u:%u", &opt.minSize, &opt.maxSize) != 2)
+        {
+          Usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'f': opt.frag = strtoul(optarg, NULL, 10); break;
+      case 'r': opt.seed = strtoull(optarg, NULL, 10); break;
+      default:
+        Usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (optind != argc - 1 || opt.minSize > opt.maxSize ||
+      opt.bytesPerSec < 512 || opt.secPerClus == 0 || opt.numFats == 0)
+  {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  if (opt.minSize == 0)
+    opt.minSize = 1;
+
+  int fd = open(argv[optind], O_RDWR | O_CREAT, 0644);
+
+  if (fd < 0)
+  {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  ImageBuilder builder(opt, fd);
+  bool built = builder.Build();
+
+  close(fd);
+  return built ? 0 : 1;
+}
@@ -0,0 +1,405 @@
+#include <storage.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <exception>
+
+// Bytes in each block of the BlockStorage cache, aligned for O_DIRECT
+#define CACHE_BLOCK 4096
+// Blocks kept by the BlockStorage cache
+#define CACHE_BLOCKS 4096
+
+// Opens the backend kind asks for, the caller checks HasError
+Storage* Storage::Open(std::string name, Kind kind)
+{
+  struct stat fstatus;
+
+  if (kind == AUTO)
+  {
+    bool device = stat(name.c_str(), &fstatus) == 0 && 
+                  S_ISBLK(fstatus.st_mode);
+    kind = device ? BLOCK : MAP;
+  }
+
+  if (kind == MAP)
+    return new MapStorage(name);
+
+  return new BlockStorage(name, kind == DIRECT);
+}
+
+Storage::Storage() : fd_(-1), error_(false), size_(0), map_(NULL)
+{
+}
+
+Storage::~Storage()
+{
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+bool Storage::HasError()
+{
+  return error_;
+}
+
+size_t Storage::Size()
+{
+  return size_;
+}
+
+uint8_t* Storage::Map()
+{
+  return map_;
+}
+
+int Storage::Fd()
+{
+  return fd_;
+}
+
+size_t Storage::Alignment()
+{
+  return 1;
+}
+
+// The page cache backs both the mapping and the descriptor, so there is
+// nothing to do by default
+void Storage::Bypass(size_t, size_t)
+{
+}
+
+// Opens the image with flags and finds its size, which block devices 
+// report through an ioctl rather than stat
+bool Storage::OpenImage(std::string name, int flags)
+{
+  struct stat fstatus;
+
+  fd_ = open(name.c_str(), flags);
+
+  if (fd_ < 0 || fstat(fd_, &fstatus) < 0)
+    return false;
+
+  if (S_ISBLK(fstatus.st_mode))
+  {
+    uint64_t bytes = 0;
+    if (ioctl(fd_, BLKGETSIZE64, &bytes) < 0)
+      return false;
+    size_ = bytes;
+  }
+  else
+    size_ = fstatus.st_size;
+
+  return size_ > 0;
+}
+
+MapStorage::MapStorage(std::string name) : Storage()
+{
+  if (!OpenImage(name, O_RDWR))
+  {
+    error_ = true;
+    return;
+  }
+
+  void* map = mmap(0, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+
+  if (map == MAP_FAILED)
+  {
+    error_ = true;
+    return;
+  }
+  map_ = (uint8_t*)map;
+}
+
+MapStorage::~MapStorage()
+{
+  if (map_ != NULL)
+    munmap(map_, size_);
+}
+
+void MapStorage::Read(void* data, size_t len, size_t pos)
+{
+  if (len + pos > size_)
+    throw std::exception();
+
+  memcpy(data, map_ + pos, len);
+}
+
+void MapStorage::Write(const void* data, size_t len, size_t pos)
+{
+  if (len + pos > size_)
+    throw std::exception();
+
+  memcpy(map_ + pos, data, len);
+}
+
+void MapStorage::Fill(uint8_t value, size_t len, size_t pos)
+{
+  if (len + pos > size_)
+    throw std::exception();
+
+  memset(map_ + pos, value, len);
+}
+
+void MapStorage::WillNeed(size_t pos, size_t len)
+{
+  size_t pageMask = sysconf(_SC_PAGESIZE) - 1;
+  size_t begin = pos & ~pageMask;
+
+  if (len + pos > size_)
+    len = size_ - pos;
+
+  madvise(map_ + begin, pos + len - begin, MADV_WILLNEED);
+}
+
+void MapStorage::Sync()
+{
+  msync(map_, size_, MS_SYNC);
+}
+
+BlockStorage::BlockStorage(std::string name, bool direct) : Storage(), 
+                                                            lru_(), 
+                                                            index_(),
+                                                            lock_(),
+                                                            direct_(false)
+{
+  // O_DIRECT needs every transfer a whole aligned block, the last
+  // partial block of an odd sized image could not be written
+  if (direct && OpenImage(name, O_RDWR | O_DIRECT) && 
+      size_ % CACHE_BLOCK == 0)
+  {
+    direct_ = true;
+    return;
+  }
+
+  if (fd_ >= 0)
+    close(fd_);
+
+  if (!OpenImage(name, O_RDWR))
+    error_ = true;
+}
+
+BlockStorage::~BlockStorage()
+{
+  try
+  {
+    Sync();
+  }
+  catch (std::exception &e)
+  {
+  }
+
+  for (Block& block : lru_)
+    free(block.data);
+}
+
+// Returns the cached block at index, loading it from the device first if
+// fill is set, and evicting the least recently used one if need be.
+// Must be called with lock_ held
+BlockStorage::Block& BlockStorage::GetBlock(size_t index, bool fill)
+{
+  auto found = index_.find(index);
+
+  if (found != index_.end())
+  {
+    lru_.splice(lru_.begin(), lru_, found->second);
+    return lru_.front();
+  }
+
+  if (lru_.size() >= CACHE_BLOCKS)
+  {
+    Block& victim = lru_.back();
+    WriteBlock(victim);
+    index_.erase(victim.index);
+    lru_.splice(lru_.begin(), lru_, std::prev(lru_.end()));
+  }
+  else
+  {
+    void* data = NULL;
+    if (posix_memalign(&data, CACHE_BLOCK, CACHE_BLOCK) != 0)
+      throw std::exception();
+
+    Block block = { 0, (uint8_t*)data, false };
+    lru_.push_front(block);
+  }
+
+  Block& block = lru_.front();
+  block.index = index;
+  block.dirty = false;
+  index_[index] = lru_.begin();
+
+  if (fill)
+  {
+    size_t done = 0;
+
+    while (done < CACHE_BLOCK)
+    {
+      ssize_t got = pread(fd_, block.data + done, CACHE_BLOCK - done,
+                          index * CACHE_BLOCK + done);
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got < 0)
+      {
+        index_.erase(index);
+        lru_.front().index = (size_t)-1;
+        throw std::exception();
+      }
+      if (got == 0)
+        break;
+      done += got;
+    }
+
+    // Past the end of the image
+    memset(block.data + done, 0, CACHE_BLOCK - done);
+  }
+  else
+    memset(block.data, 0, CACHE_BLOCK);
+
+  return block;
+}
+
+// Writes block back to the device if it has changed
+void BlockStorage::WriteBlock(Block& block)
+{
+  if (!block.dirty)
+    return;
+
+  size_t pos = block.index * CACHE_BLOCK;
+  size_t len = std::min<size_t>(CACHE_BLOCK, size_ - pos);
+  size_t done = 0;
+
+  while (done < len)
+  {
+    ssize_t put = pwrite(fd_, block.data + done, len - done, pos + done);
+    if (put < 0 && errno == EINTR)
+      continue;
+    if (put <= 0)
+      throw std::exception();
+    done += put;
+  }
+  block.dirty = false;
+}
+
+void BlockStorage::Read(void* data, size_t len, size_t pos)
+{
+  if (len + pos > size_)
+    throw std::exception();
+
+  std::lock_guard<std::mutex> guard(lock_);
+  uint8_t* out = (uint8_t*)data;
+
+  while (len > 0)
+  {
+    size_t offset = pos % CACHE_BLOCK;
+    size_t piece = std::min<size_t>(len, CACHE_BLOCK - offset);
+    Block& block = GetBlock(pos / CACHE_BLOCK, true);
+
+    memcpy(out, block.data + offset, piece);
+    out += piece;
+    pos += piece;
+    len -= piece;
+  }
+}
+
+void BlockStorage::Write(const void* data, size_t len, size_t pos)
+{
+  if (len + pos > size_)
+    throw std::exception();
+
+  std::lock_guard<std::mutex> guard(lock_);
+  const uint8_t* in = (const uint8_t*)data;
+
+  while (len > 0)
+  {
+    size_t offset = pos % CACHE_BLOCK;
+    size_t piece = std::min<size_t>(len, CACHE_BLOCK - offset);
+    // A block written over in full need not be read first
+    Block& block = GetBlock(pos / CACHE_BLOCK, piece != CACHE_BLOCK);
+
+    memcpy(block.data + offset, in, piece);
+    block.dirty = true;
+    in += piece;
+    pos += piece;
+    len -= piece;
+  }
+}
+
+void BlockStorage::Fill(uint8_t value, size_t len, size_t pos)
+{
+  if (len + pos > size_)
+    throw std::exception();
+
+  std::lock_guard<std::mutex> guard(lock_);
+
+  while (len > 0)
+  {
+    size_t offset = pos % CACHE_BLOCK;
+    size_t piece = std::min<size_t>(len, CACHE_BLOCK - offset);
+    Block& block = GetBlock(pos / CACHE_BLOCK, piece != CACHE_BLOCK);
+
+    memset(block.data + offset, value, piece);
+    block.dirty = true;
+    pos += piece;
+    len -= piece;
+  }
+}
+
+size_t BlockStorage::Alignment()
+{
+  return direct_ ? CACHE_BLOCK : 1;
+}
+
+// Writes back and drops the cached blocks overlapping the range. Dropped
+// blocks go to the back of the list to be reused first
+void BlockStorage::Bypass(size_t pos, size_t len)
+{
+  if (len == 0)
+    return;
+
+  std::lock_guard<std::mutex> guard(lock_);
+
+  for (size_t b = pos / CACHE_BLOCK; b <= (pos + len - 1) / CACHE_BLOCK; ++b)
+  {
+    auto found = index_.find(b);
+    if (found == index_.end())
+      continue;
+
+    WriteBlock(*found->second);
+    found->second->index = (size_t)-1;
+    lru_.splice(lru_.end(), lru_, found->second);
+    index_.erase(found);
+  }
+}
+
+void BlockStorage::WillNeed(size_t pos, size_t len)
+{
+  posix_fadvise(fd_, pos, len, POSIX_FADV_WILLNEED);
+}
+
+// Writes every dirty block back in device order
+void BlockStorage::Sync()
+{
+  std::lock_guard<std::mutex> guard(lock_);
+  std::vector<Block*> dirty;
+
+  for (Block& block : lru_)
+  {
+    if (block.dirty)
+      dirty.push_back(&block);
+  }
+
+  std::sort(dirty.begin(), dirty.end(), 
+            [] (Block* a, Block* b) { return a->index < b->index; });
+
+  for (Block* block : dirty)
+    WriteBlock(*block);
+
+  fsync(fd_);
+}
@@ -0,0 +1,108 @@
+#ifndef _STORAGE_H
+#define _STORAGE_H
+
+#include <string>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+// Byte addressed access to the device or file holding the filesystem.
+// Reads and writes out of range or failing on the device throw
+class Storage
+{
+  public:
+    enum Kind
+    {
+      // Block devices get BLOCK, anything else MAP
+      AUTO,
+      // Whole image mapped into memory
+      MAP,
+      // pread and pwrite through a bounded cache of aligned blocks
+      BLOCK,
+      // BLOCK with O_DIRECT, bypassing the page cache
+      DIRECT
+    };
+
+    static Storage* Open(std::string, Kind);
+    virtual ~Storage();
+
+    bool HasError();
+    size_t Size();
+    // Start of the image in memory, or NULL if the backend is not mapped
+    uint8_t* Map();
+    // Descriptor of the image, for transfers that go around the backend
+    int Fd();
+    // Alignment such transfers need in position, length and memory
+    virtual size_t Alignment();
+    // Makes the device current for a range and forgets anything cached
+    // for it, before the range is read or written through Fd
+    virtual void Bypass(size_t, size_t);
+
+    virtual void Read(void*, size_t, size_t) = 0;
+    virtual void Write(const void*, size_t, size_t) = 0;
+    virtual void Fill(uint8_t, size_t, size_t) = 0;
+    // Hints that a range will be read soon
+    virtual void WillNeed(size_t, size_t) = 0;
+    // Returns once every write so far is on the device
+    virtual void Sync() = 0;
+
+  protected:
+    Storage();
+    bool OpenImage(std::string, int);
+
+    int fd_;
+    bool error_;
+    size_t size_;
+    uint8_t* map_;
+};
+
+class MapStorage : public Storage
+{
+  public:
+    MapStorage(std::string);
+    ~MapStorage();
+
+    void Read(void*, size_t, size_t);
+    void Write(const void*, size_t, size_t);
+    void Fill(uint8_t, size_t, size_t);
+    void WillNeed(size_t, size_t);
+    void Sync();
+};
+
+// Keeps the most recently used blocks of the device in memory and writes
+// dirty ones back when they are evicted or on Sync. Safe to call from
+// several threads at once
+class BlockStorage : public Storage
+{
+  public:
+    BlockStorage(std::string, bool);
+    ~BlockStorage();
+
+    void Read(void*, size_t, size_t);
+    void Write(const void*, size_t, size_t);
+    void Fill(uint8_t, size_t, size_t);
+    void WillNeed(size_t, size_t);
+    void Sync();
+    size_t Alignment();
+    void Bypass(size_t, size_t);
+
+  private:
+    struct Block
+    {
+        size_t index;
+        uint8_t* data;
+        bool dirty;
+    };
+
+    std::list<Block> lru_;
+    std::unordered_map<size_t, std::list<Block>::iterator> index_;
+    std::mutex lock_;
+    bool direct_;
+
+    Block& GetBlock(size_t, bool);
+    void WriteBlock(Block&);
+};
+#endif
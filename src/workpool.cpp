@@ -0,0 +1,191 @@
+#include <workpool.h>
+
+// Worker the calling thread belongs to, or -1 outside of any pool
+static thread_local size_t currentWorker = (size_t)-1;
+static thread_local WorkPool* currentPool = 0;
+
+// Starts size workers, or one per core if size is 0
+WorkPool::WorkPool(size_t size) : threads_(), 
+                                  queues_(), 
+                                  idleLock_(),
+                                  wake_(),
+                                  done_(),
+                                  pending_(0),
+                                  queued_(0),
+                                  next_(0),
+                                  stop_(false)
+{
+  if (size == 0)
+    size = std::thread::hardware_concurrency();
+  if (size == 0)
+    size = 1;
+
+  for (size_t i = 0; i < size; ++i)
+    queues_.push_back(new Queue);
+
+  for (size_t i = 0; i < size; ++i)
+    threads_.push_back(std::thread(&WorkPool::Run, this, i));
+}
+
+// Stops the workers once they are out of work
+WorkPool::~WorkPool()
+{
+  Wait();
+
+  {
+    std::lock_guard<std::mutex> guard(idleLock_);
+    stop_ = true;
+  }
+  wake_.notify_all();
+
+  for (std::thread& t : threads_)
+    t.join();
+
+  for (Queue* q : queues_)
+    delete q;
+}
+
+// Returns the number of workers
+size_t WorkPool::Size()
+{
+  return threads_.size();
+}
+
+// Queues a task, tasks submitted by a worker go on its own deque. The
+// task is passed the index of the worker that runs it
+void WorkPool::Submit(Task task)
+{
+  size_t target = currentPool == this ? currentWorker : 
+                  next_.fetch_add(1) % queues_.size();
+
+  ++pending_;
+  ++queued_;
+  {
+    std::lock_guard<std::mutex> guard(queues_[target]->lock);
+    queues_[target]->tasks.push_back(task);
+  }
+
+  std::lock_guard<std::mutex> guard(idleLock_);
+  wake_.notify_one();
+}
+
+// Blocks until every submitted task, and every task they submitted, is done
+void WorkPool::Wait()
+{
+  std::unique_lock<std::mutex> guard(idleLock_);
+  done_.wait(guard, [this] { return pending_ == 0; });
+}
+
+// Gets the newest task of worker, or failing that the oldest task of 
+// any other worker
+bool WorkPool::Take(size_t worker, Task& task)
+{
+  {
+    Queue* own = queues_[worker];
+    std::lock_guard<std::mutex> guard(own->lock);
+    if (!own->tasks.empty())
+    {
+      task = own->tasks.back();
+      own->tasks.pop_back();
+      --queued_;
+      return true;
+    }
+  }
+
+  for (size_t i = 1; i < queues_.size(); ++i)
+  {
+    Queue* other = queues_[(worker + i) % queues_.size()];
+    std::lock_guard<std::mutex> guard(other->lock);
+    if (!other->tasks.empty())
+    {
+      task = other->tasks.front();
+      other->tasks.pop_front();
+      --queued_;
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkPool::Run(size_t worker)
+{
+  currentWorker = worker;
+  currentPool = this;
+
+  while (1)
+  {
+    Task task;
+
+    if (Take(worker, task))
+    {
+      // A throwing task must not take the worker down with it, tasks
+      // report their own failures
+      try
+      {
+        task(worker);
+      }
+      catch (...)
+      {
+      }
+
+      if (--pending_ == 0)
+      {
+        std::lock_guard<std::mutex> guard(idleLock_);
+        done_.notify_all();
+      }
+      continue;
+    }
+
+    // Submit counts a task as queued before it takes idleLock_ to notify,
+    // so checking under the lock can not miss one
+    std::unique_lock<std::mutex> guard(idleLock_);
+    wake_.wait(guard, [this] { return stop_ || queued_ > 0; });
+
+    if (stop_ && queued_ == 0)
+      return;
+  }
+}
+
+RwLock::RwLock() : lock_(), 
+                   readers_(), 
+                   writers_(), 
+                   active_(0), 
+                   waiting_(0), 
+                   writing_(false)
+{
+}
+
+// Takes the lock, alongside other readers if shared is set
+void RwLock::Lock(bool shared)
+{
+  std::unique_lock<std::mutex> guard(lock_);
+
+  if (shared)
+  {
+    readers_.wait(guard, [this] { return !writing_ && waiting_ == 0; });
+    ++active_;
+    return;
+  }
+
+  ++waiting_;
+  writers_.wait(guard, [this] { return !writing_ && active_ == 0; });
+  --waiting_;
+  writing_ = true;
+}
+
+// Releases the lock taken by Lock with the same shared flag
+void RwLock::Unlock(bool shared)
+{
+  std::lock_guard<std::mutex> guard(lock_);
+
+  if (shared)
+    --active_;
+  else
+    writing_ = false;
+
+  // Writers go first, readers are only let in once none are waiting
+  if (waiting_ > 0)
+    writers_.notify_one();
+  else
+    readers_.notify_all();
+}
@@ -0,0 +1,64 @@
+#ifndef _WORKPOOL_H
+#define _WORKPOOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+// Fixed set of worker threads, each with its own task deque. Workers run
+// their newest task first and steal the oldest task of another worker
+// when they run dry, so tasks spawning tasks spread across every core
+class WorkPool
+{
+  public:
+    typedef std::function<void (size_t)> Task;
+
+    WorkPool(size_t = 0);
+    void Submit(Task);
+    void Wait();
+    size_t Size();
+    ~WorkPool();
+
+  private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::thread> threads_;
+    std::vector<Queue*> queues_;
+    std::mutex idleLock_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    std::atomic<size_t> pending_;
+    std::atomic<size_t> queued_;
+    std::atomic<size_t> next_;
+    bool stop_;
+
+    void Run(size_t);
+    bool Take(size_t, Task&);
+};
+
+// Held shared by any number of readers or alone by one writer. A waiting
+// writer keeps new readers out, so a stream of readers can not starve it
+class RwLock
+{
+  public:
+    RwLock();
+    void Lock(bool);
+    void Unlock(bool);
+
+  private:
+    std::mutex lock_;
+    std::condition_variable readers_;
+    std::condition_variable writers_;
+    size_t active_;
+    size_t waiting_;
+    bool writing_;
+};
+#endif